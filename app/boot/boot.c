@@ -0,0 +1,274 @@
+#include "boot.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/linker/section_tags.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/crc.h>
+
+LOG_MODULE_REGISTER(boot, LOG_LEVEL_INF);
+
+#define BOOT_RECORD_MAGIC 0x53544232 /* "STB2" */
+#define BOOT_MS_UNSET UINT32_MAX
+
+/* Settings key of the boot counters ("stlab/boot/cnt"). The handler is more
+ * specific than the "stlab" one of cfg.c, so the counters can be loaded
+ * before cfgInit().
+ */
+#define BOOT_SETTINGS_SUBTREE "stlab/boot"
+#define BOOT_SETTINGS_NAME "cnt"
+
+/* Boot counters kept in flash, so they also count power-on and brownout
+ * resets, which do not retain RAM. Written once per boot and once more at
+ * the first CONNACK.
+ */
+struct bootCounters {
+	uint32_t boot_count;
+	/* Consecutive boots that did not reach BOOT_MS_MQTT_CONNECTED,
+	 * including the running one once bootInit() has saved it.
+	 */
+	uint32_t unconnected;
+};
+
+/* Timeline kept in RAM that is not cleared on reset. It survives software,
+ * watchdog and pin resets but not a power cycle, where the checksum no
+ * longer matches and the timeline starts over.
+ */
+struct bootRecord {
+	uint32_t magic;
+	uint32_t reset_cause;
+	/* Last milestone reached by the previous boot. */
+	int32_t prev_milestone;
+	int32_t cur_milestone;
+	/* Uptime in ms at each milestone, BOOT_MS_UNSET if not reached. */
+	uint32_t prev_ms[BOOT_MS_COUNT];
+	uint32_t cur_ms[BOOT_MS_COUNT];
+	uint32_t crc;
+};
+
+static __noinit struct bootRecord boot_record;
+static struct k_spinlock boot_lock;
+
+/* Counters as loaded from flash, only read by bootInit(). */
+static struct bootCounters boot_stored;
+
+/* Counters of this boot. loop_count excludes the running boot. */
+static uint32_t boot_count;
+static uint32_t loop_count;
+
+/**
+ * @brief Settings handler for "stlab/boot".
+ */
+static int boot_settings_set(const char *name, size_t len,
+			     settings_read_cb read_cb, void *cb_arg) {
+	const char *next;
+	int ret;
+
+	if (!settings_name_steq(name, BOOT_SETTINGS_NAME, &next) || next) {
+		return -ENOENT;
+	}
+
+	if (len != sizeof(boot_stored)) {
+		return 0;
+	}
+
+	ret = read_cb(cb_arg, &boot_stored, sizeof(boot_stored));
+
+	return (ret < 0) ? ret : 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(stlab_boot, BOOT_SETTINGS_SUBTREE, NULL,
+			       boot_settings_set, NULL, NULL);
+
+/**
+ * @brief Persist the boot counter and the boots not connected so far.
+ */
+static void boot_counters_save(uint32_t unconnected) {
+	struct bootCounters counters = {
+		.boot_count = boot_count,
+		.unconnected = unconnected,
+	};
+	int err = settings_save_one(BOOT_SETTINGS_SUBTREE "/" BOOT_SETTINGS_NAME,
+				    &counters, sizeof(counters));
+
+	if (err) {
+		LOG_ERR("Failed to persist boot counters, error: %d", err);
+	}
+}
+
+static uint32_t boot_record_crc(void) {
+	return crc32_ieee((const uint8_t *)&boot_record,
+			  offsetof(struct bootRecord, crc));
+}
+
+/**
+ * @brief Count this boot and start a new boot timeline.
+ *
+ * @param reset_cause Reset cause reported by hwinfo for this boot.
+ *
+ * @details The boot counters are loaded from flash and saved back with this
+ *          boot already counted as not connected, so a boot that never
+ *          reaches BOOT_MS_MQTT_CONNECTED counts towards the boot loop
+ *          counter whatever the reset. If the retained timeline left by the
+ *          previous boot is intact, it is kept as the previous boot.
+ */
+void bootInit(uint32_t reset_cause) {
+	int err;
+
+	err = settings_subsys_init();
+	if (!err) {
+		err = settings_load_subtree(BOOT_SETTINGS_SUBTREE);
+	}
+	if (err) {
+		LOG_ERR("Failed to load boot counters, error: %d", err);
+	}
+
+	boot_count = boot_stored.boot_count + 1;
+	loop_count = boot_stored.unconnected;
+	boot_counters_save(loop_count + 1);
+
+	k_spinlock_key_t key = k_spin_lock(&boot_lock);
+
+	if (boot_record.magic != BOOT_RECORD_MAGIC || boot_record.crc != boot_record_crc()) {
+		memset(&boot_record, 0, sizeof(boot_record));
+		boot_record.magic = BOOT_RECORD_MAGIC;
+		boot_record.cur_milestone = -1;
+		memset(boot_record.cur_ms, 0xff, sizeof(boot_record.cur_ms));
+	}
+
+	boot_record.reset_cause = reset_cause;
+	boot_record.prev_milestone = boot_record.cur_milestone;
+	memcpy(boot_record.prev_ms, boot_record.cur_ms, sizeof(boot_record.prev_ms));
+	boot_record.cur_milestone = -1;
+	memset(boot_record.cur_ms, 0xff, sizeof(boot_record.cur_ms));
+	boot_record.crc = boot_record_crc();
+
+	k_spin_unlock(&boot_lock, key);
+
+	LOG_INF("Boot %u, previous boot reached milestone %d, boot loop count %u",
+		boot_count, boot_record.prev_milestone, loop_count);
+
+	bootMilestoneSet(BOOT_MS_START);
+}
+
+/**
+ * @brief Record that a startup milestone has been reached.
+ *
+ * @param ms Milestone reached.
+ *
+ * @details Only the first time a milestone is reached in a boot is kept, so
+ *          reconnections do not overwrite the startup timeline. Reaching
+ *          BOOT_MS_MQTT_CONNECTED clears the boot loop counter in flash.
+ */
+void bootMilestoneSet(enum bootMilestone ms) {
+	bool first = false;
+	k_spinlock_key_t key = k_spin_lock(&boot_lock);
+
+	if (boot_record.cur_ms[ms] == BOOT_MS_UNSET) {
+		boot_record.cur_ms[ms] = k_uptime_get_32();
+		if ((int32_t)ms > boot_record.cur_milestone) {
+			boot_record.cur_milestone = ms;
+		}
+		boot_record.crc = boot_record_crc();
+		first = true;
+	}
+
+	k_spin_unlock(&boot_lock, key);
+
+	/* Flash is written outside the spinlock. */
+	if (first && ms == BOOT_MS_MQTT_CONNECTED) {
+		boot_counters_save(0);
+	}
+}
+
+/**
+ * @brief Check whether the device is in a boot loop.
+ *
+ * @return true if at least CONFIG_BOOT_LOOP_THRESHOLD consecutive boots did
+ *         not reach the MQTT broker.
+ */
+bool bootDegraded(void) {
+	return loop_count >= CONFIG_BOOT_LOOP_THRESHOLD;
+}
+
+/**
+ * @brief Seconds to hold back the radio in degraded startup mode.
+ *
+ * @return 0 if not in a boot loop, otherwise CONFIG_BOOT_LOOP_BACKOFF_S
+ *         doubled for every further failed boot, capped to
+ *         CONFIG_BOOT_LOOP_BACKOFF_MAX_S.
+ */
+uint32_t bootBackoffGet(void) {
+	if (!bootDegraded()) {
+		return 0;
+	}
+
+	uint32_t shift = MIN(loop_count - CONFIG_BOOT_LOOP_THRESHOLD, 16);
+	uint64_t backoff = (uint64_t)CONFIG_BOOT_LOOP_BACKOFF_S << shift;
+
+	return (uint32_t)MIN(backoff, CONFIG_BOOT_LOOP_BACKOFF_MAX_S);
+}
+
+/**
+ * @brief Append milestone timestamps as a comma separated list.
+ *
+ * @param buf   Destination buffer.
+ * @param len   Size of @p buf.
+ * @param pos   Offset in @p buf to append at.
+ * @param times Timestamps of every milestone.
+ *
+ * @return New offset, >= @p len if the buffer is too small.
+ */
+static size_t boot_times_format(char *buf, size_t len, size_t pos,
+				const uint32_t *times) {
+	for (int i = 0; i < BOOT_MS_COUNT && pos < len; i++) {
+		const char *sep = (i > 0) ? "," : "";
+
+		if (times[i] == BOOT_MS_UNSET) {
+			pos += snprintf(buf + pos, len - pos, "%s", sep);
+		} else {
+			pos += snprintf(buf + pos, len - pos, "%s%u", sep, times[i]);
+		}
+	}
+
+	return pos;
+}
+
+/**
+ * @brief Format the boot record as a compact MQTT payload.
+ *
+ * @param buf Destination buffer.
+ * @param len Size of @p buf.
+ *
+ * @return Length of the payload, or -ENOMEM if it does not fit in @p buf.
+ *
+ * @details The payload has the form
+ *          "n=<boots>;rc=<reset cause>;bl=<loop count>;pm=<previous last
+ *          milestone>;pt=<previous timeline>;t=<current timeline>", where a
+ *          timeline lists the uptime in ms of every enum bootMilestone and
+ *          leaves milestones that were not reached empty.
+ */
+int bootRecordFormat(char *buf, size_t len) {
+	struct bootRecord rec;
+	size_t pos;
+
+	k_spinlock_key_t key = k_spin_lock(&boot_lock);
+	rec = boot_record;
+	k_spin_unlock(&boot_lock, key);
+
+	pos = snprintf(buf, len, "n=%u;rc=%x;bl=%u;pm=%d;pt=", boot_count,
+		       rec.reset_cause, loop_count, rec.prev_milestone);
+	pos = boot_times_format(buf, len, pos, rec.prev_ms);
+	if (pos < len) {
+		pos += snprintf(buf + pos, len - pos, ";t=");
+	}
+	pos = boot_times_format(buf, len, pos, rec.cur_ms);
+
+	if (pos >= len) {
+		return -ENOMEM;
+	}
+
+	return pos;
+}
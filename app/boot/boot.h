@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Startup milestones, in the order they are reached. */
+enum bootMilestone {
+	BOOT_MS_START,
+	BOOT_MS_CFG_LOADED,
+	BOOT_MS_MODEM_INIT,
+	BOOT_MS_LTE_REGISTERED,
+	BOOT_MS_MQTT_INIT,
+	BOOT_MS_MQTT_CONNECTED,
+	BOOT_MS_COUNT
+};
+
+/**@brief Count the boot in flash and start a new boot timeline
+ */
+void bootInit(uint32_t reset_cause);
+
+/**@brief Record that a startup milestone has been reached
+ */
+void bootMilestoneSet(enum bootMilestone ms);
+
+/**@brief Check whether the device is in a boot loop
+ */
+bool bootDegraded(void);
+
+/**@brief Seconds to hold back the radio in degraded startup mode
+ */
+uint32_t bootBackoffGet(void);
+
+/**@brief Format the boot record as a compact MQTT payload
+ */
+int bootRecordFormat(char *buf, size_t len);
@@ -0,0 +1,523 @@
+#include "cfg.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+LOG_MODULE_REGISTER(cfg, LOG_LEVEL_INF);
+
+/* Settings key of the persisted configuration blob ("stlab/cfg"). */
+#define CFG_SETTINGS_SUBTREE "stlab"
+#define CFG_SETTINGS_NAME "cfg"
+
+enum cfgFieldType {
+	CFG_FIELD_U32,
+	CFG_FIELD_STR,
+};
+
+/* Description of one key accepted on the configuration topic. */
+struct cfgField {
+	const char *key;
+	enum cfgFieldType type;
+	size_t offset;
+	size_t size;
+	uint32_t min;
+	uint32_t max;
+};
+
+#define CFG_U32(_key, _member, _min, _max) {				\
+	.key = _key, .type = CFG_FIELD_U32,				\
+	.offset = offsetof(struct cfgData, _member),			\
+	.size = sizeof(uint32_t), .min = _min, .max = _max }
+
+#define CFG_STR(_key, _member) {					\
+	.key = _key, .type = CFG_FIELD_STR,				\
+	.offset = offsetof(struct cfgData, _member),			\
+	.size = sizeof(((struct cfgData *)0)->_member) }
+
+static const struct cfgField cfg_fields[] = {
+	CFG_U32("ver", version, 1, UINT32_MAX),
+	CFG_U32("period", publish_period_s, 5, 86400),
+	CFG_U32("reconnect", reconnect_delay_s, 1, 3600),
+#if defined(CONFIG_MQTT_CFG_REMOTE_BROKER)
+	CFG_U32("port", broker_port, 1, 65535),
+	CFG_STR("host", broker_host),
+#endif
+	CFG_STR("pub", pub_topic),
+	CFG_STR("sub", sub_topic),
+};
+
+#define CFG_DEFAULTS {						\
+	.publish_period_s = CONFIG_MQTT_PUBLISH_PERIOD_S,		\
+	.reconnect_delay_s = CONFIG_MQTT_RECONNECT_DELAY_S,		\
+	.broker_port = CONFIG_MQTT_BROKER_PORT,				\
+	.broker_host = CONFIG_MQTT_BROKER_HOSTNAME,			\
+	.pub_topic = CONFIG_MQTT_PUB_TOPIC,				\
+	.sub_topic = CONFIG_MQTT_SUB_TOPIC }
+
+/* Current configuration, guarded by cfg_mutex. Starts from the Kconfig
+ * defaults so threads running before cfgInit() see sane values.
+ */
+static struct cfgData cfg = CFG_DEFAULTS;
+
+/* Configuration as persisted, guarded by cfg_mutex. It only differs from cfg
+ * in the broker while a new broker has not been confirmed by a CONNACK.
+ */
+static struct cfgData cfg_saved = CFG_DEFAULTS;
+K_MUTEX_DEFINE(cfg_mutex);
+
+/* Scratch copy of the downlink message, only used by cfgApply(). */
+static char cfg_line[CONFIG_MQTT_PAYLOAD_BUFFER_SIZE + 1];
+
+/**
+ * @brief Settings handler for the "stlab" subtree.
+ *
+ * @details Restores the configuration blob saved by cfgApply(). A blob with
+ *          a different size comes from an incompatible firmware and is
+ *          ignored, leaving the Kconfig defaults in place.
+ */
+static int cfg_settings_set(const char *name, size_t len,
+			    settings_read_cb read_cb, void *cb_arg) {
+	const char *next;
+	struct cfgData stored;
+	int ret;
+
+	if (!settings_name_steq(name, CFG_SETTINGS_NAME, &next) || next) {
+		return -ENOENT;
+	}
+
+	if (len != sizeof(stored)) {
+		LOG_WRN("Ignoring stored configuration (%u bytes, expected %u)",
+			(unsigned int)len, (unsigned int)sizeof(stored));
+		return 0;
+	}
+
+	ret = read_cb(cb_arg, &stored, sizeof(stored));
+	if (ret < 0) {
+		return ret;
+	}
+
+	stored.broker_host[sizeof(stored.broker_host) - 1] = '\0';
+	stored.pub_topic[sizeof(stored.pub_topic) - 1] = '\0';
+	stored.sub_topic[sizeof(stored.sub_topic) - 1] = '\0';
+
+#if !defined(CONFIG_MQTT_CFG_REMOTE_BROKER)
+	/* A broker stored while remote broker changes were allowed is dropped. */
+	snprintf(stored.broker_host, sizeof(stored.broker_host), "%s",
+		 CONFIG_MQTT_BROKER_HOSTNAME);
+	stored.broker_port = CONFIG_MQTT_BROKER_PORT;
+#endif
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	cfg = stored;
+	cfg_saved = stored;
+	k_mutex_unlock(&cfg_mutex);
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(stlab_cfg, CFG_SETTINGS_SUBTREE, NULL,
+			       cfg_settings_set, NULL, NULL);
+
+/**
+ * @brief Persist cfg_saved. Call with cfg_mutex held.
+ *
+ * @details Holding the mutex keeps concurrent saves in order, so the blob in
+ *          flash always matches cfg_saved.
+ */
+static int cfg_save(void) {
+	int err = settings_save_one(CFG_SETTINGS_SUBTREE "/" CFG_SETTINGS_NAME,
+				    &cfg_saved, sizeof(cfg_saved));
+
+	if (err) {
+		LOG_ERR("Failed to persist configuration, error: %d", err);
+	}
+
+	return err;
+}
+
+/**
+ * @brief Check whether the broker in use has not been persisted yet. Call
+ *        with cfg_mutex held.
+ */
+static bool cfg_broker_unsaved(void) {
+	return cfg.broker_port != cfg_saved.broker_port ||
+	       strcmp(cfg.broker_host, cfg_saved.broker_host) != 0;
+}
+
+/**
+ * @brief Check that a string value is usable as hostname or topic.
+ *
+ * @param field Field being assigned.
+ * @param value NUL terminated value.
+ *
+ * @return true if the value is valid for @p field.
+ */
+static bool cfg_str_valid(const struct cfgField *field, const char *value) {
+	size_t len = strlen(value);
+
+	if (len == 0 || len >= field->size) {
+		return false;
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		if (!isgraph((unsigned char)value[i])) {
+			return false;
+		}
+	}
+
+	/* Wildcards are only allowed when subscribing. */
+	if (field->offset == offsetof(struct cfgData, pub_topic) &&
+	    strpbrk(value, "+#") != NULL) {
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief Assign one "key=value" pair to a configuration candidate.
+ *
+ * @param next  Configuration candidate.
+ * @param key   Key of the pair.
+ * @param value Value of the pair.
+ *
+ * @return 0 on success, -EINVAL if the key is unknown or the value is out
+ *         of range.
+ */
+static int cfg_field_set(struct cfgData *next, const char *key, const char *value) {
+	for (size_t i = 0; i < ARRAY_SIZE(cfg_fields); i++) {
+		const struct cfgField *field = &cfg_fields[i];
+		uint8_t *dst = (uint8_t *)next + field->offset;
+
+		if (strcmp(key, field->key) != 0) {
+			continue;
+		}
+
+		if (field->type == CFG_FIELD_U32) {
+			char *end;
+			unsigned long val;
+
+			/* strtoul() accepts a sign and wraps "-1" to ULONG_MAX. */
+			errno = 0;
+			val = strtoul(value, &end, 10);
+
+			if (!isdigit((unsigned char)*value) || *end != '\0' ||
+			    errno == ERANGE || val < field->min || val > field->max) {
+				LOG_ERR("Invalid value for \"%s\": %s", key, value);
+				return -EINVAL;
+			}
+
+			*(uint32_t *)dst = (uint32_t)val;
+		} else {
+			if (!cfg_str_valid(field, value)) {
+				LOG_ERR("Invalid value for \"%s\": %s", key, value);
+				return -EINVAL;
+			}
+
+			strcpy((char *)dst, value);
+		}
+
+		return 0;
+	}
+
+	LOG_ERR("Unknown configuration key \"%s\"", key);
+	return -EINVAL;
+}
+
+/**
+ * @brief Load the configuration.
+ *
+ * @details Loads the "stlab" settings subtree over the Kconfig defaults, so
+ *          a configuration received earlier over MQTT survives resets.
+ *
+ * @return 0 on success, negative error code if the settings storage could not
+ *         be read. The Kconfig defaults are still in place in that case.
+ */
+int cfgInit(void) {
+	int err;
+
+	err = settings_subsys_init();
+	if (err) {
+		LOG_ERR("Failed to initialize settings, error: %d", err);
+		return err;
+	}
+
+	err = settings_load_subtree(CFG_SETTINGS_SUBTREE);
+	if (err) {
+		LOG_ERR("Failed to load settings, error: %d", err);
+		return err;
+	}
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	LOG_INF("Config version %u, period %u s, broker %s:%u",
+		cfg.version, cfg.publish_period_s, cfg.broker_host, cfg.broker_port);
+	k_mutex_unlock(&cfg_mutex);
+
+	return 0;
+}
+
+/**
+ * @brief Copy the current configuration.
+ *
+ * @param out Destination of the copy.
+ */
+void cfgGet(struct cfgData *out) {
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	*out = cfg;
+	k_mutex_unlock(&cfg_mutex);
+}
+
+/**
+ * @brief Get the publish period.
+ *
+ * @details Lets threads with small stacks read one value without copying the
+ *          whole configuration.
+ *
+ * @return Publish period in seconds.
+ */
+uint32_t cfgPublishPeriodGet(void) {
+	uint32_t period;
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	period = cfg.publish_period_s;
+	k_mutex_unlock(&cfg_mutex);
+
+	return period;
+}
+
+/**
+ * @brief Get the reconnect delay.
+ *
+ * @return Reconnect delay in seconds.
+ */
+uint32_t cfgReconnectDelayGet(void) {
+	uint32_t delay;
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	delay = cfg.reconnect_delay_s;
+	k_mutex_unlock(&cfg_mutex);
+
+	return delay;
+}
+
+/**
+ * @brief Get the configuration version.
+ *
+ * @return Version in effect, 0 before any configuration message.
+ */
+uint32_t cfgVersionGet(void) {
+	uint32_t version;
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	version = cfg.version;
+	k_mutex_unlock(&cfg_mutex);
+
+	return version;
+}
+
+/**
+ * @brief Copy the command subscription topic.
+ *
+ * @param buf Destination of the topic.
+ * @param len Size of @p buf, CFG_TOPIC_LEN holds any topic.
+ */
+void cfgSubTopicGet(char *buf, size_t len) {
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	snprintf(buf, len, "%s", cfg.sub_topic);
+	k_mutex_unlock(&cfg_mutex);
+}
+
+/**
+ * @brief Copy the publish topic.
+ *
+ * @param buf Destination of the topic.
+ * @param len Size of @p buf, CFG_TOPIC_LEN holds any topic.
+ */
+void cfgPubTopicGet(char *buf, size_t len) {
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	snprintf(buf, len, "%s", cfg.pub_topic);
+	k_mutex_unlock(&cfg_mutex);
+}
+
+/**
+ * @brief Apply a configuration downlink message.
+ *
+ * @param data    Message payload.
+ * @param len     Length of the payload.
+ * @param changed Set to the CFG_CHANGED_* bits of the parameters that differ
+ *                from the previous configuration.
+ *
+ * @return 0 on success, -EMSGSIZE if the message does not fit the scratch
+ *         buffer, -EINVAL if the message is malformed or its version jumps
+ *         more than CONFIG_MQTT_CFG_VERSION_MAX_STEP ahead, -EALREADY if its
+ *         version is not newer than the current one, or a negative settings
+ *         error if it could not be persisted. The configuration is applied
+ *         in memory even if persisting it fails.
+ *
+ * @details The payload is a list of "key=value" pairs separated by ';' or new
+ *          lines, for example "ver=7;period=60;reconnect=10". Accepted keys
+ *          are ver, period, reconnect, pub and sub, plus host and port with
+ *          CONFIG_MQTT_CFG_REMOTE_BROKER; "ver" is mandatory. Keys that are not present keep their current
+ *          value. The message is validated as a whole, either every pair is
+ *          applied or none is.
+ *
+ *          A new broker is only used in memory; the previous broker stays
+ *          persisted until cfgBrokerConfirm() reports a CONNACK from the new
+ *          one, so a wrong host or port cannot lock the device out after a
+ *          reset.
+ */
+int cfgApply(const uint8_t *data, size_t len, uint32_t *changed) {
+	struct cfgData next;
+	char *save = NULL;
+	char *pair;
+	bool has_version = false;
+	int err;
+
+	*changed = 0;
+
+	if (len >= sizeof(cfg_line)) {
+		return -EMSGSIZE;
+	}
+
+	memcpy(cfg_line, data, len);
+	cfg_line[len] = '\0';
+
+	cfgGet(&next);
+
+	for (pair = strtok_r(cfg_line, ";\r\n", &save); pair != NULL;
+	     pair = strtok_r(NULL, ";\r\n", &save)) {
+		char *value = strchr(pair, '=');
+
+		if (value == NULL) {
+			LOG_ERR("Malformed configuration pair \"%s\"", pair);
+			return -EINVAL;
+		}
+		*value++ = '\0';
+
+		err = cfg_field_set(&next, pair, value);
+		if (err < 0) {
+			return err;
+		}
+
+		if (strcmp(pair, "ver") == 0) {
+			has_version = true;
+		}
+	}
+
+	if (!has_version) {
+		LOG_ERR("Configuration without version");
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+
+	if (next.version <= cfg.version) {
+		k_mutex_unlock(&cfg_mutex);
+		LOG_WRN("Ignoring configuration version %u, current is %u",
+			next.version, cfg.version);
+		return -EALREADY;
+	}
+
+	/* A huge version would block every later message. */
+	if (next.version - cfg.version > CONFIG_MQTT_CFG_VERSION_MAX_STEP) {
+		k_mutex_unlock(&cfg_mutex);
+		LOG_ERR("Configuration version %u too far ahead of %u",
+			next.version, cfg.version);
+		return -EINVAL;
+	}
+
+	if (next.publish_period_s != cfg.publish_period_s) {
+		*changed |= CFG_CHANGED_PUBLISH_PERIOD;
+	}
+	if (next.reconnect_delay_s != cfg.reconnect_delay_s) {
+		*changed |= CFG_CHANGED_RECONNECT_DELAY;
+	}
+	if (next.broker_port != cfg.broker_port ||
+	    strcmp(next.broker_host, cfg.broker_host) != 0) {
+		*changed |= CFG_CHANGED_BROKER;
+	}
+	if (strcmp(next.pub_topic, cfg.pub_topic) != 0) {
+		*changed |= CFG_CHANGED_PUB_TOPIC;
+	}
+	if (strcmp(next.sub_topic, cfg.sub_topic) != 0) {
+		*changed |= CFG_CHANGED_SUB_TOPIC;
+	}
+
+	cfg = next;
+
+	/* Keep the last confirmed broker in flash. */
+	strcpy(next.broker_host, cfg_saved.broker_host);
+	next.broker_port = cfg_saved.broker_port;
+	cfg_saved = next;
+
+	LOG_INF("Applied configuration version %u (changes 0x%02x)",
+		next.version, *changed);
+
+	err = cfg_save();
+	k_mutex_unlock(&cfg_mutex);
+
+	return err;
+}
+
+/**
+ * @brief Report a CONNACK from the broker in use.
+ *
+ * @details Persists the broker if it was changed by cfgApply() and not
+ *          confirmed yet, does nothing otherwise.
+ */
+void cfgBrokerConfirm(void) {
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+
+	if (cfg_broker_unsaved()) {
+		LOG_INF("Broker %s:%u confirmed", cfg.broker_host, cfg.broker_port);
+		strcpy(cfg_saved.broker_host, cfg.broker_host);
+		cfg_saved.broker_port = cfg.broker_port;
+		cfg_save();
+	}
+
+	k_mutex_unlock(&cfg_mutex);
+}
+
+/**
+ * @brief Check whether the broker in use still waits for a CONNACK.
+ *
+ * @return true if the broker was changed by cfgApply() and not confirmed.
+ */
+bool cfgBrokerPending(void) {
+	bool pending;
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	pending = cfg_broker_unsaved();
+	k_mutex_unlock(&cfg_mutex);
+
+	return pending;
+}
+
+/**
+ * @brief Go back to the last confirmed broker.
+ *
+ * @return true if the broker in use changed.
+ *
+ * @details The other parameters and the version of the configuration are
+ *          kept, so a later message still needs a newer version.
+ */
+bool cfgBrokerRevert(void) {
+	bool reverted;
+
+	k_mutex_lock(&cfg_mutex, K_FOREVER);
+	reverted = cfg_broker_unsaved();
+	if (reverted) {
+		LOG_WRN("Reverting broker %s:%u to %s:%u", cfg.broker_host,
+			cfg.broker_port, cfg_saved.broker_host, cfg_saved.broker_port);
+		strcpy(cfg.broker_host, cfg_saved.broker_host);
+		cfg.broker_port = cfg_saved.broker_port;
+	}
+	k_mutex_unlock(&cfg_mutex);
+
+	return reverted;
+}
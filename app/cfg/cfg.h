@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <zephyr/sys/util.h>
+
+#define CFG_HOST_LEN 64
+#define CFG_TOPIC_LEN 64
+
+/* Bits reported by cfgApply() for the parameters that changed. */
+#define CFG_CHANGED_PUBLISH_PERIOD BIT(0)
+#define CFG_CHANGED_RECONNECT_DELAY BIT(1)
+#define CFG_CHANGED_BROKER BIT(2)
+#define CFG_CHANGED_PUB_TOPIC BIT(3)
+#define CFG_CHANGED_SUB_TOPIC BIT(4)
+
+/**@brief Runtime application configuration.
+ */
+struct cfgData {
+	uint32_t version;
+	uint32_t publish_period_s;
+	uint32_t reconnect_delay_s;
+	uint32_t broker_port;
+	char broker_host[CFG_HOST_LEN];
+	char pub_topic[CFG_TOPIC_LEN];
+	char sub_topic[CFG_TOPIC_LEN];
+};
+
+/**@brief Load the Kconfig defaults and overlay the persisted configuration
+ */
+int cfgInit(void);
+
+/**@brief Copy the current configuration
+ */
+void cfgGet(struct cfgData *out);
+
+/**@brief Get the publish period in seconds
+ */
+uint32_t cfgPublishPeriodGet(void);
+
+/**@brief Get the reconnect delay in seconds
+ */
+uint32_t cfgReconnectDelayGet(void);
+
+/**@brief Get the configuration version
+ */
+uint32_t cfgVersionGet(void);
+
+/**@brief Copy the command subscription topic
+ */
+void cfgSubTopicGet(char *buf, size_t len);
+
+/**@brief Copy the publish topic
+ */
+void cfgPubTopicGet(char *buf, size_t len);
+
+/**@brief Validate, apply and persist a configuration downlink message
+ */
+int cfgApply(const uint8_t *data, size_t len, uint32_t *changed);
+
+/**@brief Persist a changed broker once it has accepted a connection
+ */
+void cfgBrokerConfirm(void);
+
+/**@brief Check whether a changed broker has not accepted a connection yet
+ */
+bool cfgBrokerPending(void);
+
+/**@brief Go back to the last broker that accepted a connection
+ */
+bool cfgBrokerRevert(void);
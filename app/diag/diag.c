@@ -0,0 +1,318 @@
+#include "diag.h"
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/sys_heap.h>
+#if defined(CONFIG_SHELL)
+#include <zephyr/shell/shell.h>
+#endif
+
+LOG_MODULE_REGISTER(diag, LOG_LEVEL_INF);
+
+/* Fill pattern of registered buffers, same idea as CONFIG_INIT_STACKS. */
+#define DIAG_PAINT 0xAA
+
+/* Thread names are cut to this length in the MQTT payload. */
+#define DIAG_NAME_LEN 10
+
+struct diagBufferInfo {
+	const char *name;
+	const uint8_t *buf;
+	size_t size;
+};
+
+static struct diagBufferInfo diag_buffers[DIAG_BUF_COUNT];
+
+/* Usage of one thread, collected by diag_thread_get(). */
+struct diagThread {
+	const char *name;
+	size_t size;
+	size_t used;
+	uint32_t cpu_pct;
+	uint64_t cpu_ms;
+};
+
+/* State of diagFormat() while walking the thread list. */
+struct diagFormatCtx {
+	char *buf;
+	size_t len;
+	size_t pos;
+	/* Index of the thread being walked, and of the first one on the page. */
+	unsigned int index;
+	unsigned int first;
+	/* Index of the first thread that did not fit, 0 if all did. */
+	unsigned int next;
+};
+
+/* Stack usage of main(), which exits and leaves the thread list. */
+static struct diagThread diag_main;
+
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS) && (CONFIG_HEAP_MEM_POOL_SIZE > 0)
+extern struct k_heap _system_heap;
+#endif
+
+/**
+ * @brief Paint a static buffer so its high-water mark can be measured.
+ *
+ * @param id   Buffer to register.
+ * @param name Short name used in reports.
+ * @param buf  Buffer, filled with DIAG_PAINT.
+ * @param size Size of @p buf.
+ *
+ * @details Must be called before the buffer is first used. A payload that
+ *          ends in DIAG_PAINT bytes makes the mark read slightly low.
+ */
+void diagBufferRegister(enum diagBuffer id, const char *name, uint8_t *buf, size_t size) {
+	memset(buf, DIAG_PAINT, size);
+
+	diag_buffers[id].name = name;
+	diag_buffers[id].buf = buf;
+	diag_buffers[id].size = size;
+}
+
+/**
+ * @brief Get the high-water mark of a registered buffer.
+ *
+ * @return Number of bytes from the start of the buffer that have been
+ *         written at least once.
+ */
+static size_t diag_buffer_used(const struct diagBufferInfo *info) {
+	size_t used = info->size;
+
+	while (used > 0 && info->buf[used - 1] == DIAG_PAINT) {
+		used--;
+	}
+
+	return used;
+}
+
+/**
+ * @brief Collect stack and CPU usage of a thread.
+ *
+ * @param thread Thread to inspect.
+ * @param out    Collected usage.
+ */
+static void diag_thread_get(const struct k_thread *thread, struct diagThread *out) {
+	size_t unused = 0;
+
+	out->name = k_thread_name_get((k_tid_t)thread);
+	if (out->name == NULL || out->name[0] == '\0') {
+		out->name = "?";
+	}
+
+	out->size = thread->stack_info.size;
+	out->used = 0;
+	if (k_thread_stack_space_get(thread, &unused) == 0) {
+		out->used = out->size - unused;
+	}
+
+	out->cpu_pct = 0;
+	out->cpu_ms = 0;
+#if defined(CONFIG_THREAD_RUNTIME_STATS)
+	k_thread_runtime_stats_t rt;
+	k_thread_runtime_stats_t all;
+
+	if (k_thread_runtime_stats_get((k_tid_t)thread, &rt) == 0 &&
+	    k_thread_runtime_stats_all_get(&all) == 0) {
+		out->cpu_ms = k_cyc_to_ms_floor64(rt.execution_cycles);
+		if (all.execution_cycles > 0) {
+			out->cpu_pct = (uint32_t)(rt.execution_cycles * 100 / all.execution_cycles);
+		}
+	}
+#endif
+}
+
+/**
+ * @brief Record the stack usage of the calling thread as the main thread.
+ *
+ * @details Meant to be called by main() right before it returns. The thread
+ *          then leaves the thread list, so its usage is kept here and
+ *          reported with the other threads.
+ */
+void diagMainRecord(void) {
+	diag_thread_get(k_current_get(), &diag_main);
+	diag_main.name = "main";
+
+	LOG_INF("main stack used %u / %u", (unsigned int)diag_main.used,
+		(unsigned int)diag_main.size);
+}
+
+/**
+ * @brief Count the next thread and check whether it belongs on the page.
+ *
+ * @return false if the thread is on an earlier page or the page is full.
+ */
+static bool diag_format_wanted(struct diagFormatCtx *ctx) {
+	return ctx->next == 0 && ctx->index++ >= ctx->first;
+}
+
+/**
+ * @brief Append the entry of the thread just counted, or end the page if it
+ *        does not fit.
+ */
+static void diag_format_entry(struct diagFormatCtx *ctx, const struct diagThread *info) {
+	char entry[DIAG_NAME_LEN + 24];
+	bool empty = (ctx->buf[ctx->pos - 1] == '=');
+	int n;
+
+	n = snprintf(entry, sizeof(entry), "%s%.*s:%u/%u/%u", empty ? "" : ",",
+		     DIAG_NAME_LEN, info->name, (unsigned int)info->used,
+		     (unsigned int)info->size, info->cpu_pct);
+
+	if (n < 0 || ctx->pos + n >= ctx->len) {
+		/* An entry that does not even fit an empty page is dropped. */
+		if (!empty) {
+			ctx->next = ctx->index - 1;
+		}
+		return;
+	}
+
+	memcpy(ctx->buf + ctx->pos, entry, n + 1);
+	ctx->pos += n;
+}
+
+static void diag_format_thread(const struct k_thread *thread, void *user_data) {
+	struct diagFormatCtx *ctx = user_data;
+	struct diagThread info;
+
+	if (diag_format_wanted(ctx)) {
+		diag_thread_get(thread, &info);
+		diag_format_entry(ctx, &info);
+	}
+}
+
+/**
+ * @brief Format the buffer and heap summary that opens the first page.
+ *
+ * @return Length written, >= @p len if the summary does not fit.
+ */
+static size_t diag_format_summary(char *buf, size_t len) {
+	size_t pos = snprintf(buf, len, "buf=");
+
+	for (int i = 0; i < DIAG_BUF_COUNT && pos < len; i++) {
+		const struct diagBufferInfo *info = &diag_buffers[i];
+
+		if (info->buf == NULL) {
+			continue;
+		}
+
+		pos += snprintf(buf + pos, len - pos, "%s%s:%u/%u",
+				(buf[pos - 1] == '=') ? "" : ",", info->name,
+				(unsigned int)diag_buffer_used(info), (unsigned int)info->size);
+	}
+
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS) && (CONFIG_HEAP_MEM_POOL_SIZE > 0)
+	struct sys_memory_stats heap;
+
+	if (pos < len && sys_heap_runtime_stats_get(&_system_heap.heap, &heap) == 0) {
+		pos += snprintf(buf + pos, len - pos, ";heap=%u/%u/%u",
+				(unsigned int)heap.allocated_bytes,
+				(unsigned int)heap.max_allocated_bytes,
+				(unsigned int)(heap.allocated_bytes + heap.free_bytes));
+	}
+#endif
+
+	if (pos < len) {
+		pos += snprintf(buf + pos, len - pos, ";thr=");
+	}
+
+	return pos;
+}
+
+/**
+ * @brief Format one page of thread, buffer and heap usage as a compact MQTT
+ *        payload.
+ *
+ * @param buf  Destination buffer.
+ * @param len  Size of @p buf.
+ * @param next Index of the first thread of the page, 0 for the first page.
+ *             Set to the index for the next page, or 0 once every thread has
+ *             been reported.
+ *
+ * @return Length of the payload, or -ENOMEM if @p buf cannot even hold the
+ *         buffer and heap summary.
+ *
+ * @details The first page has the form
+ *          "buf=rx:<used>/<size>,...;heap=<used>/<max>/<size>;thr=<name>:
+ *          <stack used>/<stack size>/<cpu %>,...", the following pages only
+ *          "thr=..." with the threads that did not fit before. main() is
+ *          reported last once diagMainRecord() has run.
+ */
+int diagFormat(char *buf, size_t len, unsigned int *next) {
+	struct diagFormatCtx ctx = {
+		.buf = buf,
+		.len = len,
+		.first = *next,
+	};
+
+	if (ctx.first == 0) {
+		ctx.pos = diag_format_summary(buf, len);
+	} else {
+		ctx.pos = snprintf(buf, len, "thr=");
+	}
+
+	if (ctx.pos >= len) {
+		return -ENOMEM;
+	}
+
+	k_thread_foreach_unlocked(diag_format_thread, &ctx);
+
+	if (diag_main.size > 0 && diag_format_wanted(&ctx)) {
+		diag_format_entry(&ctx, &diag_main);
+	}
+
+	*next = ctx.next;
+
+	return ctx.pos;
+}
+
+#if defined(CONFIG_SHELL)
+static void diag_shell_thread(const struct k_thread *thread, void *user_data) {
+	const struct shell *sh = user_data;
+	struct diagThread info;
+
+	diag_thread_get(thread, &info);
+
+	shell_print(sh, "  %-20s stack %5u / %5u  cpu %3u%% %8llu ms", info.name,
+		    (unsigned int)info.used, (unsigned int)info.size,
+		    info.cpu_pct, (unsigned long long)info.cpu_ms);
+}
+
+static int cmd_diag(const struct shell *sh, size_t argc, char **argv) {
+	ARG_UNUSED(argc);
+	ARG_UNUSED(argv);
+
+	shell_print(sh, "Buffers (high-water / size):");
+	for (int i = 0; i < DIAG_BUF_COUNT; i++) {
+		const struct diagBufferInfo *info = &diag_buffers[i];
+
+		if (info->buf != NULL) {
+			shell_print(sh, "  %-20s %5u / %5u", info->name,
+				    (unsigned int)diag_buffer_used(info), (unsigned int)info->size);
+		}
+	}
+
+#if defined(CONFIG_SYS_HEAP_RUNTIME_STATS) && (CONFIG_HEAP_MEM_POOL_SIZE > 0)
+	struct sys_memory_stats heap;
+
+	if (sys_heap_runtime_stats_get(&_system_heap.heap, &heap) == 0) {
+		shell_print(sh, "Heap: %u used, %u max, %u size",
+			    (unsigned int)heap.allocated_bytes,
+			    (unsigned int)heap.max_allocated_bytes,
+			    (unsigned int)(heap.allocated_bytes + heap.free_bytes));
+	}
+#endif
+
+	shell_print(sh, "Threads (stack used / size, cpu):");
+	k_thread_foreach_unlocked(diag_shell_thread, (void *)sh);
+	if (diag_main.size > 0) {
+		shell_print(sh, "  %-20s stack %5u / %5u  (exited)", diag_main.name,
+			    (unsigned int)diag_main.used, (unsigned int)diag_main.size);
+	}
+
+	return 0;
+}
+
+SHELL_CMD_REGISTER(diag, NULL, "Print stack, buffer, heap and CPU usage", cmd_diag);
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Static buffers whose utilisation is tracked. */
+enum diagBuffer {
+	DIAG_BUF_RX,
+	DIAG_BUF_TX,
+	DIAG_BUF_PAYLOAD,
+	DIAG_BUF_COUNT
+};
+
+/**@brief Paint a static buffer so its high-water mark can be measured
+ */
+void diagBufferRegister(enum diagBuffer id, const char *name, uint8_t *buf, size_t size);
+
+/**@brief Record the stack usage of main() before it returns
+ */
+void diagMainRecord(void);
+
+/**@brief Format one page of thread, buffer and heap usage as a compact MQTT payload
+ */
+int diagFormat(char *buf, size_t len, unsigned int *next);
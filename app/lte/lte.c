@@ -1,4 +1,6 @@
 #include "lte.h"
+#include "boot.h"
+#include "modem.h"
 #include <stdio.h>
 #include <ncs_version.h>
 #include <zephyr/kernel.h>
@@ -29,11 +31,13 @@ static void lte_handler(const struct lte_lc_evt *const evt) {
 		LOG_INF("Network registration status: %s",
 				evt->nw_reg_status == LTE_LC_NW_REG_REGISTERED_HOME ?
 				"Connected - home network" : "Connected - roaming");
+		bootMilestoneSet(BOOT_MS_LTE_REGISTERED);
 		k_sem_give(&lte_connected);
         break;
 	case LTE_LC_EVT_RRC_UPDATE:
 		LOG_INF("RRC mode: %s", evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED ?
 				"Connected" : "Idle");
+		modemRrcSet(evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED);
 		break;
      default:
              break;
@@ -60,6 +64,8 @@ void lteInit(void) {
 		return;
 	}
 
+	bootMilestoneSet(BOOT_MS_MODEM_INIT);
+
 	lte_lc_modem_events_enable();
 
 	/* Set modem to LTE-M only */
@@ -77,5 +83,7 @@ void lteInit(void) {
 
 	k_sem_take(&lte_connected, K_FOREVER);
 
+	modemPrefetch();
+
 	return;
 }
@@ -11,6 +11,9 @@
 #include <zephyr/sys/__assert.h>
 #include <zephyr/sys/reboot.h>
 
+#include "boot.h"
+#include "cfg.h"
+#include "diag.h"
 #include "lte.h"
 #include "mqtt.h"
 
@@ -77,6 +80,11 @@ uint32_t appl_reset_cause(int *flags, uint16_t *reboot_code) {
         } else {
             LOG_INF("No reset cause or error reading reset cause (error: %d)", reset_error);
         }
+
+        /* Reset cause bits accumulate until cleared, clear them so the next
+         * boot reports its own cause only.
+         */
+        hwinfo_clear_reset_cause();
     }
     
     return cause;
@@ -87,7 +95,24 @@ int main(void) {
 	int reset_cause = 0;
 	uint16_t reboot_cause = 0;
 
-	appl_reset_cause(&reset_cause, &reboot_cause);
+	bootInit(appl_reset_cause(&reset_cause, &reboot_cause));
+
+	cfgInit();
+	bootMilestoneSet(BOOT_MS_CFG_LOADED);
+
+	/* In a boot loop, skip the settle delays and hold the radio back
+	 * instead of registering again right away.
+	 */
+	if (bootDegraded()) {
+		uint32_t backoff = bootBackoffGet();
+
+		LOG_WRN("Boot loop detected, starting LTE in %u seconds", backoff);
+		k_sleep(K_SECONDS(backoff));
+		lteInit();
+		mqttInit();
+		diagMainRecord();
+		return 0;
+	}
 
 	k_sleep(K_MSEC(100));
 
@@ -97,5 +122,8 @@ int main(void) {
 
 	mqttInit();
 
+	/* main() exits here, record its stack usage while it still can */
+	diagMainRecord();
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,388 @@
+#include "modem.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <nrf_modem_at.h>
+
+LOG_MODULE_REGISTER(modem, LOG_LEVEL_INF);
+
+/* Stack size and priority for the modem query worker thread */
+#define MODEM_QUERY_THREAD_STACK_SIZE 1536
+#define MODEM_QUERY_THREAD_PRIORITY 8
+
+#define MODEM_RESPONSE_LEN 96
+
+/* AT command of a query, and how long its result stays valid. */
+struct modemQueryInfo {
+	const char *cmd;
+	const char *prefix;
+	/* 0 for results that never change. */
+	uint32_t ttl_ms;
+};
+
+static const struct modemQueryInfo modem_queries[MODEM_Q_COUNT] = {
+	[MODEM_Q_IMEI] = { "AT+CGSN", NULL, 0 },
+	[MODEM_Q_ICCID] = { "AT%XICCID", "%XICCID: ", 0 },
+	[MODEM_Q_FW_VERSION] = { "AT+CGMR", NULL, 0 },
+	[MODEM_Q_SIGNAL] = { "AT+CESQ", "+CESQ: ", 30 * MSEC_PER_SEC },
+	[MODEM_Q_CELL] = { "AT+CEREG?", "+CEREG: ", 60 * MSEC_PER_SEC },
+	[MODEM_Q_TEMPERATURE] = { "AT%XTEMP?", "%XTEMP: ", 60 * MSEC_PER_SEC },
+	[MODEM_Q_BATTERY] = { "AT%XVBAT", "%XVBAT: ", 60 * MSEC_PER_SEC },
+};
+
+struct modemCacheEntry {
+	bool valid;
+	int64_t time;
+	/* Incremented every time the command runs, successfully or not. */
+	uint32_t seq;
+	int err;
+	char value[MODEM_VALUE_LEN];
+};
+
+/* Request passed to the worker. MODEM_Q_COUNT only wakes it up. */
+struct modemRequest {
+	enum modemQuery q;
+	bool urgent;
+	modemQueryCb cb;
+	void *user_data;
+};
+
+static struct modemCacheEntry modem_cache[MODEM_Q_COUNT];
+K_MUTEX_DEFINE(modem_mutex);
+K_CONDVAR_DEFINE(modem_cond);
+
+K_MSGQ_DEFINE(modem_msgq, sizeof(struct modemRequest), CONFIG_MODEM_QUERY_QUEUE_SIZE, 4);
+
+static atomic_t modem_rrc_connected = ATOMIC_INIT(0);
+
+/* Non-urgent requests waiting for an RRC connected window, worker only. */
+static struct modemRequest modem_pending[CONFIG_MODEM_QUERY_QUEUE_SIZE];
+static size_t modem_pending_count;
+static int64_t modem_pending_since;
+
+/* Thread definition */
+static void modemQueryThread(void);
+
+/* Create the thread */
+K_THREAD_DEFINE(modemQuery_Thread, MODEM_QUERY_THREAD_STACK_SIZE,
+                modemQueryThread, NULL, NULL, NULL,
+                MODEM_QUERY_THREAD_PRIORITY, 0, 0);
+
+/**
+ * @brief Check whether a cached result can be used. Call with modem_mutex held.
+ */
+static bool modem_cache_valid(enum modemQuery q) {
+	const struct modemCacheEntry *entry = &modem_cache[q];
+	uint32_t ttl = modem_queries[q].ttl_ms;
+
+	return entry->valid && (ttl == 0 || k_uptime_get() - entry->time < ttl);
+}
+
+/**
+ * @brief Run the AT command of a query and store the result in the cache.
+ *
+ * @param q     Query to run.
+ * @param value Set to the result, without the response prefix and the
+ *              final "OK".
+ *
+ * @return 0 on success, negative error code on failure.
+ */
+static int modem_query_run(enum modemQuery q, char *value) {
+	static char resp[MODEM_RESPONSE_LEN];
+	const struct modemQueryInfo *info = &modem_queries[q];
+	struct modemCacheEntry *entry = &modem_cache[q];
+	const char *start = resp;
+	int err;
+
+	/* Commands contain '%', so they are passed as an argument. */
+	err = nrf_modem_at_cmd(resp, sizeof(resp), "%s", info->cmd);
+	if (err > 0) {
+		/* Positive values are AT error responses. */
+		LOG_ERR("%s failed, error: %d", info->cmd, err);
+		err = -EIO;
+	} else if (err < 0) {
+		LOG_ERR("%s failed, error: %d", info->cmd, err);
+	} else {
+		if (info->prefix != NULL && !strncmp(resp, info->prefix, strlen(info->prefix))) {
+			start += strlen(info->prefix);
+		}
+		snprintf(value, MODEM_VALUE_LEN, "%.*s", (int)strcspn(start, "\r\n"), start);
+	}
+
+	k_mutex_lock(&modem_mutex, K_FOREVER);
+	entry->seq++;
+	entry->err = err;
+	if (err == 0) {
+		entry->valid = true;
+		entry->time = k_uptime_get();
+		memcpy(entry->value, value, MODEM_VALUE_LEN);
+	}
+	k_condvar_broadcast(&modem_cond);
+	k_mutex_unlock(&modem_mutex);
+
+	return err;
+}
+
+/**
+ * @brief Serve a request from the cache, or run its command.
+ */
+static void modem_request_serve(const struct modemRequest *req) {
+	char value[MODEM_VALUE_LEN];
+	int err = modemCachedGet(req->q, value, sizeof(value));
+
+	if (err) {
+		err = modem_query_run(req->q, value);
+	}
+
+	if (req->cb != NULL) {
+		req->cb(req->q, err, (err == 0) ? value : NULL, req->user_data);
+	}
+}
+
+/**
+ * @brief Hold a non-urgent request until the next RRC connected window.
+ *
+ * @details Served right away if the pending list is full.
+ */
+static void modem_request_defer(const struct modemRequest *req) {
+	if (modem_pending_count == ARRAY_SIZE(modem_pending)) {
+		modem_request_serve(req);
+		return;
+	}
+
+	if (modem_pending_count == 0) {
+		modem_pending_since = k_uptime_get();
+	}
+
+	modem_pending[modem_pending_count++] = *req;
+}
+
+/**
+ * @brief Thread serving the modem queries.
+ *
+ * @details Urgent requests and requests answered by the cache are served in
+ *          order. Other requests wait until the RRC connection is up, when
+ *          the modem is awake anyway, or for at most
+ *          CONFIG_MODEM_QUERY_DEFER_S seconds.
+ */
+static void modemQueryThread(void) {
+	struct modemRequest req;
+
+	while (1) {
+		k_timeout_t wait = K_FOREVER;
+
+		if (modem_pending_count > 0) {
+			int64_t left = modem_pending_since +
+				       CONFIG_MODEM_QUERY_DEFER_S * MSEC_PER_SEC - k_uptime_get();
+
+			wait = (left > 0) ? K_MSEC(left) : K_NO_WAIT;
+		}
+
+		if (k_msgq_get(&modem_msgq, &req, wait) == 0 && req.q < MODEM_Q_COUNT) {
+			bool cached;
+
+			k_mutex_lock(&modem_mutex, K_FOREVER);
+			cached = modem_cache_valid(req.q);
+			k_mutex_unlock(&modem_mutex);
+
+			if (cached || req.urgent || atomic_get(&modem_rrc_connected)) {
+				modem_request_serve(&req);
+			} else {
+				modem_request_defer(&req);
+			}
+		}
+
+		if (modem_pending_count > 0 &&
+		    (atomic_get(&modem_rrc_connected) ||
+		     k_uptime_get() - modem_pending_since >=
+		     CONFIG_MODEM_QUERY_DEFER_S * MSEC_PER_SEC)) {
+			/* Requests for the same query after the first hit the cache. */
+			for (size_t i = 0; i < modem_pending_count; i++) {
+				modem_request_serve(&modem_pending[i]);
+			}
+			modem_pending_count = 0;
+		}
+	}
+}
+
+/**
+ * @brief Queue a modem query.
+ *
+ * @param q         Query to run.
+ * @param urgent    Run as soon as possible instead of waiting for an RRC
+ *                  connected window.
+ * @param cb        Called on the worker thread with the result, may be NULL
+ *                  to only refresh the cache.
+ * @param user_data Passed to @p cb.
+ *
+ * @return 0 on success, -EINVAL for an unknown query, -ENOMEM if the request
+ *         queue is full.
+ */
+int modemQuery(enum modemQuery q, bool urgent, modemQueryCb cb, void *user_data) {
+	struct modemRequest req = {
+		.q = q,
+		.urgent = urgent,
+		.cb = cb,
+		.user_data = user_data
+	};
+
+	if (q >= MODEM_Q_COUNT) {
+		return -EINVAL;
+	}
+
+	if (k_msgq_put(&modem_msgq, &req, K_NO_WAIT)) {
+		LOG_WRN("Modem query queue full, dropping query %d", q);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Get a query result from the cache only.
+ *
+ * @param q   Query.
+ * @param buf Destination of the result.
+ * @param len Size of @p buf.
+ *
+ * @return 0 on success, -EAGAIN if there is no valid cached result.
+ */
+int modemCachedGet(enum modemQuery q, char *buf, size_t len) {
+	int err = -EAGAIN;
+
+	if (q >= MODEM_Q_COUNT) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&modem_mutex, K_FOREVER);
+	if (modem_cache_valid(q)) {
+		snprintf(buf, len, "%s", modem_cache[q].value);
+		err = 0;
+	}
+	k_mutex_unlock(&modem_mutex);
+
+	return err;
+}
+
+/**
+ * @brief Get the last successful query result, ignoring its time to live.
+ *
+ * @param q     Query.
+ * @param buf   Destination of the result.
+ * @param len   Size of @p buf.
+ * @param age_s Set to the age of the result in seconds.
+ *
+ * @return 0 on success, -EAGAIN if the query never succeeded.
+ *
+ * @details For reports that run less often than the result expires, which
+ *          would otherwise never find a valid cached value.
+ */
+int modemLastGet(enum modemQuery q, char *buf, size_t len, uint32_t *age_s) {
+	int err = -EAGAIN;
+
+	if (q >= MODEM_Q_COUNT) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&modem_mutex, K_FOREVER);
+	if (modem_cache[q].valid) {
+		snprintf(buf, len, "%s", modem_cache[q].value);
+		*age_s = (uint32_t)((k_uptime_get() - modem_cache[q].time) / MSEC_PER_SEC);
+		err = 0;
+	}
+	k_mutex_unlock(&modem_mutex);
+
+	return err;
+}
+
+/**
+ * @brief Get a query result, waiting for the worker if it is not cached.
+ *
+ * @param q       Query.
+ * @param buf     Destination of the result.
+ * @param len     Size of @p buf.
+ * @param timeout Maximum time to wait for the worker.
+ *
+ * @return 0 on success, -EAGAIN on timeout, or the error of the AT command.
+ *
+ * @details Queues the query as urgent. Meant for callers that cannot proceed
+ *          without the result, such as building the MQTT client ID; other
+ *          callers should use modemQuery() with a callback.
+ */
+int modemQueryGet(enum modemQuery q, char *buf, size_t len, k_timeout_t timeout) {
+	k_timepoint_t end = sys_timepoint_calc(timeout);
+	uint32_t seq;
+	int err;
+
+	if (q >= MODEM_Q_COUNT) {
+		return -EINVAL;
+	}
+
+	/* The result can only become valid by bumping seq, so checking the
+	 * cache and taking seq under one lock cannot miss a result.
+	 */
+	k_mutex_lock(&modem_mutex, K_FOREVER);
+	if (modem_cache_valid(q)) {
+		snprintf(buf, len, "%s", modem_cache[q].value);
+		k_mutex_unlock(&modem_mutex);
+		return 0;
+	}
+	seq = modem_cache[q].seq;
+	k_mutex_unlock(&modem_mutex);
+
+	err = modemQuery(q, true, NULL, NULL);
+	if (err) {
+		return err;
+	}
+
+	k_mutex_lock(&modem_mutex, K_FOREVER);
+	while (modem_cache[q].seq == seq) {
+		if (k_condvar_wait(&modem_cond, &modem_mutex, sys_timepoint_timeout(end))) {
+			k_mutex_unlock(&modem_mutex);
+			return -EAGAIN;
+		}
+	}
+
+	err = modem_cache[q].err;
+	if (err == 0) {
+		snprintf(buf, len, "%s", modem_cache[q].value);
+	}
+	k_mutex_unlock(&modem_mutex);
+
+	return err;
+}
+
+/**
+ * @brief Queue the queries whose results never change.
+ *
+ * @details Called once the network is registered, so the SIM is active and
+ *          the results are cached before anyone needs them.
+ */
+void modemPrefetch(void) {
+	for (int q = 0; q < MODEM_Q_COUNT; q++) {
+		if (modem_queries[q].ttl_ms == 0) {
+			modemQuery(q, true, NULL, NULL);
+		}
+	}
+}
+
+/**
+ * @brief Report the RRC mode.
+ *
+ * @param connected true if the RRC connection is up.
+ *
+ * @details Wakes the worker so deferred queries run in the connected window.
+ */
+void modemRrcSet(bool connected) {
+	struct modemRequest wake = {
+		.q = MODEM_Q_COUNT
+	};
+
+	atomic_set(&modem_rrc_connected, connected);
+
+	if (connected) {
+		k_msgq_put(&modem_msgq, &wake, K_NO_WAIT);
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <zephyr/kernel.h>
+
+#define MODEM_VALUE_LEN 48
+
+/* Modem queries served by the modem query worker. */
+enum modemQuery {
+	MODEM_Q_IMEI,
+	MODEM_Q_ICCID,
+	MODEM_Q_FW_VERSION,
+	MODEM_Q_SIGNAL,
+	MODEM_Q_CELL,
+	MODEM_Q_TEMPERATURE,
+	MODEM_Q_BATTERY,
+	MODEM_Q_COUNT
+};
+
+/**@brief Query result callback, run on the modem query worker
+ *
+ * @p value is only valid during the call.
+ */
+typedef void (*modemQueryCb)(enum modemQuery q, int err, const char *value, void *user_data);
+
+/**@brief Queue a query, the callback runs once the result is available
+ */
+int modemQuery(enum modemQuery q, bool urgent, modemQueryCb cb, void *user_data);
+
+/**@brief Get a query result, waiting up to @p timeout for the worker
+ */
+int modemQueryGet(enum modemQuery q, char *buf, size_t len, k_timeout_t timeout);
+
+/**@brief Get a query result from the cache only
+ */
+int modemCachedGet(enum modemQuery q, char *buf, size_t len);
+
+/**@brief Get the last successful query result and its age, even if expired
+ */
+int modemLastGet(enum modemQuery q, char *buf, size_t len, uint32_t *age_s);
+
+/**@brief Queue the queries whose results never change
+ */
+void modemPrefetch(void);
+
+/**@brief Report the RRC mode so deferred queries run while connected
+ */
+void modemRrcSet(bool connected);
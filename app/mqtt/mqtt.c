@@ -1,4 +1,8 @@
 #include "mqtt.h"
+#include "boot.h"
+#include "cfg.h"
+#include "diag.h"
+#include "modem.h"
 
 /* Buffers for MQTT client. */
 static uint8_t rx_buffer[CONFIG_MQTT_MESSAGE_BUFFER_SIZE];
@@ -38,6 +42,24 @@ LOG_MODULE_REGISTER(mqtt, LOG_LEVEL_INF);
 static bool mqtt_connected = false;
 K_MUTEX_DEFINE(mqtt_mutex);
 
+/* Flags set by the configuration downlink for the connection thread. */
+#define MQTT_FLAG_RECONNECT 0
+#define MQTT_FLAG_BROKER_RESOLVE 1
+static atomic_t mqtt_flags = ATOMIC_INIT(0);
+
+/* Largest diagnostics payload that fits the TX buffer with its per-device
+ * topic: 5 bytes of fixed header, the 2 byte topic length and the '/'.
+ */
+#define MQTT_DIAG_LEN (CONFIG_MQTT_MESSAGE_BUFFER_SIZE - 8 -			\
+		       (sizeof(CONFIG_MQTT_DIAG_TOPIC) - 1) -			\
+		       MAX(sizeof(CONFIG_MQTT_CLIENT_ID), CLIENT_ID_LEN))
+
+/* Given when the publish period changes, to restart the publisher's wait. */
+static K_SEM_DEFINE(mqtt_period_changed, 0, 1);
+
+/* Topic currently subscribed, so it can be dropped when reconfigured. */
+static char sub_topic[CFG_TOPIC_LEN];
+
 /**
  * @brief Reads the received payload from the MQTT server.
  *
@@ -98,79 +120,280 @@ static int mqttGetReceivedPayload(struct mqtt_client *c, size_t length) {
  *          code on failure.
  */
 static int mqttSubscribe(struct mqtt_client *const c) {
-	struct mqtt_topic subscribe_topic = {
-		.topic = {
-			.utf8 = CONFIG_MQTT_SUB_TOPIC,
-			.size = strlen(CONFIG_MQTT_SUB_TOPIC)
+	cfgSubTopicGet(sub_topic, sizeof(sub_topic));
+
+	struct mqtt_topic subscribe_topic[] = {
+		{
+			.topic = {
+				.utf8 = (const uint8_t *)sub_topic,
+				.size = strlen(sub_topic)
+			},
+			.qos = MQTT_QOS_1_AT_LEAST_ONCE
 		},
-		.qos = MQTT_QOS_1_AT_LEAST_ONCE
+		{
+			.topic = {
+				.utf8 = CONFIG_MQTT_CFG_TOPIC,
+				.size = strlen(CONFIG_MQTT_CFG_TOPIC)
+			},
+			.qos = MQTT_QOS_1_AT_LEAST_ONCE
+		}
 	};
 
 	const struct mqtt_subscription_list subscription_list = {
-		.list = &subscribe_topic,
-		.list_count = 1,
+		.list = subscribe_topic,
+		.list_count = ARRAY_SIZE(subscribe_topic),
 		.message_id = 1234
 	};
 
-	LOG_INF("Subscribing on \"%s\"", CONFIG_MQTT_SUB_TOPIC);
+	LOG_INF("Subscribing on \"%s\" and \"%s\"", sub_topic, CONFIG_MQTT_CFG_TOPIC);
 
 	return mqtt_subscribe(c, &subscription_list);
 }
 
 /**
- * @brief Print a buffer to the log as a string.
+ * @brief Move the subscription to the configured topic.
  *
- * @param prefix A string to print before the buffer.
- * @param data   The buffer to print.
- * @param len    The length of the buffer.
+ * @param c The MQTT client instance.
+ *
+ * @return 0 on success, negative error code on failure.
  *
- * @details The buffer is null-terminated and the resulting string is
- *          printed using LOG_INF.
+ * @details Unsubscribes from the previous command topic and subscribes to
+ *          the one in the current configuration, keeping the connection up.
  */
-static void mqttDataPrint(uint8_t *prefix, uint8_t *data, size_t len, uint8_t* topic) {
-	char buf[len + 1];
+static int mqttResubscribe(struct mqtt_client *const c) {
+	struct mqtt_topic old_topic = {
+		.topic = {
+			.utf8 = (const uint8_t *)sub_topic,
+			.size = strlen(sub_topic)
+		}
+	};
 
-	memcpy(buf, data, len);
-	buf[len] = 0;
-	LOG_INF("%s\"%s\" on \"%s\"", (char *)prefix, (char *)buf, topic);
+	const struct mqtt_subscription_list unsubscribe_list = {
+		.list = &old_topic,
+		.list_count = 1,
+		.message_id = 1235
+	};
+
+	int err = mqtt_unsubscribe(c, &unsubscribe_list);
+	if (err) {
+		LOG_ERR("Failed to unsubscribe from \"%s\": %d", sub_topic, err);
+	}
+
+	return mqttSubscribe(c);
 }
 
 /**
- * @brief Publish a message to an MQTT topic.
+ * @brief Print a buffer to the log as a string.
+ *
+ * @param prefix    A string to print before the buffer.
+ * @param data      The buffer to print.
+ * @param len       The length of the buffer.
+ * @param topic     The topic, not necessarily null-terminated.
+ * @param topic_len The length of the topic.
+ *
+ * @details The buffer and topic are printed with a precision, so nothing is
+ *          copied to the stack whatever their length.
+ */
+static void mqttDataPrint(const char *prefix, const uint8_t *data, size_t len,
+	const uint8_t *topic, size_t topic_len) {
+	LOG_INF("%s\"%.*s\" on \"%.*s\"", prefix, (int)len, (const char *)data,
+		(int)topic_len, (const char *)topic);
+}
+
+/**
+ * @brief Publish a message to a given MQTT topic.
  *
  * @param c      MQTT client instance.
  * @param qos    QOS level of the message.
+ * @param topic  NUL terminated topic to publish on.
  * @param data   Buffer containing the payload.
  * @param len    Length of the payload buffer.
  *
  * @return 0 on success, negative error code on failure.
- *
- * @details Publish a message to the topic specified in the
- *          CONFIG_MQTT_PUB_TOPIC setting. The QOS level of the message
- *          is set to @p qos. The payload is taken from the buffer
- *          @p data, with length @p len.
- *
- *          The function will also return -EIO if there is an error
- *          reading the payload.
  */
-int mqttDataPublish(struct mqtt_client *c, enum mqtt_qos qos,
-	uint8_t *data, size_t len) {
+static int mqttTopicPublish(struct mqtt_client *c, enum mqtt_qos qos,
+	const char *topic, uint8_t *data, size_t len) {
 	struct mqtt_publish_param param;
 
 	param.message.topic.qos = qos;
-	param.message.topic.topic.utf8 = CONFIG_MQTT_PUB_TOPIC;
-	param.message.topic.topic.size = strlen(CONFIG_MQTT_PUB_TOPIC);
+	param.message.topic.topic.utf8 = (const uint8_t *)topic;
+	param.message.topic.topic.size = strlen(topic);
 	param.message.payload.data = data;
 	param.message.payload.len = len;
 	param.message_id = sys_rand32_get();
 	param.dup_flag = 0;
 	param.retain_flag = 0;
 
-	mqttDataPrint("Publishing ", data, len, CONFIG_MQTT_PUB_TOPIC);
+	mqttDataPrint("Publishing ", data, len, (const uint8_t *)topic, strlen(topic));
 
 	return mqtt_publish(c, &param);
 }
 
+/**
+ * @brief Publish a message on the per-device variant of a topic.
+ *
+ * @param c      MQTT client instance.
+ * @param qos    QOS level of the message.
+ * @param base   NUL terminated topic shared by the fleet.
+ * @param data   Buffer containing the payload.
+ * @param len    Length of the payload buffer.
+ *
+ * @return 0 on success, negative error code on failure.
+ *
+ * @details Publishes on "<base>/<client ID>", so reports from every device
+ *          can be told apart and subscribed to with "<base>/+". Only called
+ *          from the connection thread, which owns the topic buffer.
+ */
+static int mqttDeviceTopicPublish(struct mqtt_client *c, enum mqtt_qos qos,
+	const char *base, uint8_t *data, size_t len) {
+	static char topic[CFG_TOPIC_LEN + MAX(sizeof(CONFIG_MQTT_CLIENT_ID), CLIENT_ID_LEN)];
+
+	snprintf(topic, sizeof(topic), "%s/%.*s", base,
+		 (int)c->client_id.size, (const char *)c->client_id.utf8);
+
+	return mqttTopicPublish(c, qos, topic, data, len);
+}
+
+/**
+ * @brief Publish a message to an MQTT topic.
+ *
+ * @param c      MQTT client instance.
+ * @param qos    QOS level of the message.
+ * @param data   Buffer containing the payload.
+ * @param len    Length of the payload buffer.
+ *
+ * @return 0 on success, negative error code on failure.
+ *
+ * @details Publish a message to the configured publish topic, which
+ *          defaults to CONFIG_MQTT_PUB_TOPIC and can be changed over the
+ *          configuration topic. The QOS level of the message is set to
+ *          @p qos. The payload is taken from the buffer @p data, with
+ *          length @p len.
+ */
+int mqttDataPublish(struct mqtt_client *c, enum mqtt_qos qos,
+	uint8_t *data, size_t len) {
+	char topic[CFG_TOPIC_LEN];
+
+	cfgPubTopicGet(topic, sizeof(topic));
+
+	return mqttTopicPublish(c, qos, topic, data, len);
+}
+
+/**
+ * @brief Handle a message received on the configuration topic.
+ *
+ * @param c       MQTT client instance.
+ * @param len     Length of the payload in payload_buf.
+ * @param rx_err  Result of mqttGetReceivedPayload().
+ *
+ * @details Applies the configuration with cfgApply() and acknowledges it on
+ *          CONFIG_MQTT_CFG_ACK_TOPIC/<client ID> with the version now in
+ *          effect. Topic and
+ *          period changes are applied on the live connection; a broker change
+ *          asks the connection thread to reconnect.
+ */
+static void mqttCfgHandle(struct mqtt_client *const c, size_t len, int rx_err) {
+	static char ack[48];
+	uint32_t changed = 0;
+	int err = rx_err;
+
+	if (err >= 0) {
+		err = cfgApply(payload_buf, len, &changed);
+	}
+
+	if (changed & CFG_CHANGED_SUB_TOPIC) {
+		mqttResubscribe(c);
+	}
+
+	if (changed & CFG_CHANGED_PUBLISH_PERIOD) {
+		k_sem_give(&mqtt_period_changed);
+	}
+
+	if (changed & CFG_CHANGED_BROKER) {
+		atomic_set_bit(&mqtt_flags, MQTT_FLAG_BROKER_RESOLVE);
+		atomic_set_bit(&mqtt_flags, MQTT_FLAG_RECONNECT);
+	}
+
+	int ack_len = snprintf(ack, sizeof(ack), "ver=%u;err=%d", cfgVersionGet(), err);
+
+	err = mqttDeviceTopicPublish(c, MQTT_QOS_1_AT_LEAST_ONCE, CONFIG_MQTT_CFG_ACK_TOPIC,
+				     (uint8_t *)ack, ack_len);
+	if (err) {
+		LOG_ERR("Failed to acknowledge configuration: %d", err);
+	}
+}
+
+/**
+ * @brief Publish the retained boot record.
+ *
+ * @param c MQTT client instance.
+ *
+ * @details Called once per connection, so the startup timeline of boots that
+ *          never reached the broker is reported by the next one that does.
+ *          Published on CONFIG_MQTT_BOOT_TOPIC/<client ID>.
+ */
+static void mqttBootPublish(struct mqtt_client *const c) {
+	static char record[160];
+	int len = bootRecordFormat(record, sizeof(record));
+
+	if (len < 0) {
+		LOG_ERR("Failed to format boot record: %d", len);
+		return;
+	}
+
+	int err = mqttDeviceTopicPublish(c, MQTT_QOS_1_AT_LEAST_ONCE, CONFIG_MQTT_BOOT_TOPIC,
+					 (uint8_t *)record, len);
+	if (err) {
+		LOG_ERR("Failed to publish boot record: %d", err);
+	}
+}
+
+/**
+ * @brief Publish thread, buffer and heap usage.
+ *
+ * @param c MQTT client instance.
+ *
+ * @details Called from the connection thread, whose stack has room for the
+ *          formatting, once per connection and every
+ *          CONFIG_DIAG_PUBLISH_PERIOD_S seconds. The report is split in as
+ *          many messages on CONFIG_MQTT_DIAG_TOPIC/<client ID> as the TX
+ *          buffer requires; messages after the first start with "thr=".
+ */
+static void mqttDiagPublish(struct mqtt_client *const c) {
+	static char diag[MQTT_DIAG_LEN];
+	char signal[MODEM_VALUE_LEN];
+	unsigned int next = 0;
+	uint32_t age;
+	int len = 0;
+	int ret;
+
+	/* The last signal quality is sent with its age in seconds and refreshed
+	 * in the next RRC connected window, so the connection thread never
+	 * waits on the modem. The first report after boot has none yet.
+	 */
+	if (modemLastGet(MODEM_Q_SIGNAL, signal, sizeof(signal), &age) == 0) {
+		len = snprintf(diag, sizeof(diag), "cesq=%s;cesq_age=%u;", signal, age);
+	}
+	modemQuery(MODEM_Q_SIGNAL, false, NULL, NULL);
+
+	do {
+		ret = diagFormat(diag + len, sizeof(diag) - len, &next);
+		if (ret < 0) {
+			LOG_ERR("Failed to format diagnostics: %d", ret);
+			return;
+		}
+		len += ret;
+
+		ret = mqttDeviceTopicPublish(c, MQTT_QOS_0_AT_MOST_ONCE, CONFIG_MQTT_DIAG_TOPIC,
+					     (uint8_t *)diag, len);
+		if (ret) {
+			LOG_ERR("Failed to publish diagnostics: %d", ret);
+			return;
+		}
+		len = 0;
+	} while (next > 0);
+}
+
 /**
  * @brief MQTT event handler.
  *
@@ -190,12 +413,16 @@ void mqttEvtHandler(struct mqtt_client *const c, const struct mqtt_evt *evt) {
 			}
 
 			LOG_INF("MQTT client connected");
+			bootMilestoneSet(BOOT_MS_MQTT_CONNECTED);
+			cfgBrokerConfirm();
 
 			k_mutex_lock(&mqtt_mutex, K_FOREVER);
 			mqtt_connected = true;
 			k_mutex_unlock(&mqtt_mutex);
 
 			mqttSubscribe(c);
+			mqttBootPublish(c);
+			mqttDiagPublish(c);
 
 			break;
 
@@ -224,8 +451,14 @@ void mqttEvtHandler(struct mqtt_client *const c, const struct mqtt_evt *evt) {
 				mqtt_publish_qos1_ack(c, &ack);
 			}
 
-			if (err >= 0) {
-				mqttDataPrint("Received: ", payload_buf, p->message.payload.len, (uint8_t *)p->message.topic.topic.utf8);
+			if (p->message.topic.topic.size == strlen(CONFIG_MQTT_CFG_TOPIC) &&
+			    !memcmp(p->message.topic.topic.utf8, CONFIG_MQTT_CFG_TOPIC,
+				    p->message.topic.topic.size) &&
+			    (err >= 0 || err == -EMSGSIZE)) {
+				mqttCfgHandle(c, p->message.payload.len, err);
+			} else if (err >= 0) {
+				mqttDataPrint("Received: ", payload_buf, p->message.payload.len,
+					p->message.topic.topic.utf8, p->message.topic.topic.size);
 			// Payload buffer is smaller than the received data 
 			} else if (err == -EMSGSIZE) {
 				LOG_ERR("Received payload (%d bytes) is larger than the payload buffer size (%d bytes).",
@@ -250,6 +483,10 @@ void mqttEvtHandler(struct mqtt_client *const c, const struct mqtt_evt *evt) {
 			//LOG_INF("PUBACK packet id: %u", evt->param.puback.message_id);
 			break;
 
+		case MQTT_EVT_UNSUBACK:
+			LOG_INF("UNSUBACK packet id: %u", evt->param.unsuback.message_id);
+			break;
+
 		case MQTT_EVT_SUBACK:
 			if (evt->result != 0) {
 				LOG_ERR("MQTT SUBACK error: %d", evt->result);
@@ -274,9 +511,9 @@ void mqttEvtHandler(struct mqtt_client *const c, const struct mqtt_evt *evt) {
 /**
  * @brief Initialize the MQTT broker address.
  *
- * @details This function resolves the hostname of the MQTT broker using
- *          getaddrinfo() and sets the address of the broker in the global
- *          'broker' variable.
+ * @details This function resolves the configured hostname of the MQTT broker
+ *          using getaddrinfo() and sets the address of the broker in the
+ *          global 'broker' variable.
  *
  * @return 0 on success, or a negative error code on failure.
  */
@@ -288,8 +525,11 @@ static int mqtt_broker_init(void) {
 		.ai_family = AF_INET,
 		.ai_socktype = SOCK_STREAM
 	};
+	struct cfgData cfg;
 
-	err = getaddrinfo(CONFIG_MQTT_BROKER_HOSTNAME, NULL, &hints, &result);
+	cfgGet(&cfg);
+
+	err = getaddrinfo(cfg.broker_host, NULL, &hints, &result);
 	if (err) {
 		LOG_ERR("getaddrinfo failed: %d", err);
 		return -ECHILD;
@@ -309,7 +549,7 @@ static int mqtt_broker_init(void) {
 				((struct sockaddr_in *)addr->ai_addr)
 				->sin_addr.s_addr;
 			broker4->sin_family = AF_INET;
-			broker4->sin_port = htons(CONFIG_MQTT_BROKER_PORT);
+			broker4->sin_port = htons(cfg.broker_port);
 
 			inet_ntop(AF_INET, &broker4->sin_addr.s_addr,
 				  ipv4_addr, sizeof(ipv4_addr));
@@ -336,9 +576,9 @@ static int mqtt_broker_init(void) {
  * @brief Get the client id to use for the MQTT connection.
  *
  * @details If CONFIG_MQTT_CLIENT_ID is set, that value is used.
- *          Otherwise, the function attempts to obtain the IMEI of the device
- *          using the AT+CGSN command and generates a client id string
- *          of the form "nrf-<imei>".
+ *          Otherwise, the function obtains the IMEI of the device from the
+ *          modem query service, which normally has it cached already, and
+ *          generates a client id string of the form "nrf-<imei>".
  *
  * @return The client id to use for the MQTT connection.
  */
@@ -352,17 +592,15 @@ static const uint8_t* mqttClientIdGet(void) {
 		goto exit;
 	}
 
-	char imei_buf[CGSN_RESPONSE_LENGTH + 1];
+	char imei_buf[MODEM_VALUE_LEN];
 	int err;
 
-	err = nrf_modem_at_cmd(imei_buf, sizeof(imei_buf), "AT+CGSN");
+	err = modemQueryGet(MODEM_Q_IMEI, imei_buf, sizeof(imei_buf), K_SECONDS(10));
 	if (err) {
 		LOG_ERR("Failed to obtain IMEI, error: %d", err);
 		goto exit;
 	}
 
-	imei_buf[IMEI_LEN] = '\0';
-
 	snprintf(client_id, sizeof(client_id), "nrf-%.*s", IMEI_LEN, imei_buf);
 	LOG_INF("client_id = %s", (char *)(client_id));
 
@@ -405,6 +643,11 @@ int mqttClientInit(struct mqtt_client *client) {
 	client->user_name = NULL;
 	client->protocol_version = MQTT_VERSION_3_1_1;
 
+	/* Paint the buffers to measure their high-water marks */
+	diagBufferRegister(DIAG_BUF_RX, "rx", rx_buffer, sizeof(rx_buffer));
+	diagBufferRegister(DIAG_BUF_TX, "tx", tx_buffer, sizeof(tx_buffer));
+	diagBufferRegister(DIAG_BUF_PAYLOAD, "payload", payload_buf, sizeof(payload_buf));
+
 	/* MQTT buffers configuration */
 	client->rx_buf = rx_buffer;
 	client->rx_buf_size = sizeof(rx_buffer);
@@ -460,22 +703,49 @@ void mqttInit(void) {
 		return;
 	}
 
+	bootMilestoneSet(BOOT_MS_MQTT_INIT);
+
     k_thread_create(&mqttConnection_Thread, mqttConnection_Stack, MQTT_CONNECTION_THREAD_STACK_SIZE,
                     mqttConnectionThread, NULL, NULL, NULL,
                     MQTT_CONNECTION_THREAD_PRIORITY, 0, K_NO_WAIT);
+    k_thread_name_set(&mqttConnection_Thread, "mqttConnection");
 }
 
 void mqttConnectionThread(void *p1, void *p2, void *p3) {
 
 	int err;
 	uint16_t connect_attempt = 0;
+	uint16_t broker_attempt = 0;
+	int64_t diag_time = k_uptime_get();
 
 	while (1) {
 		do_connect:
 			if (connect_attempt++ > 0) {
-				LOG_INF("Reconnecting in %d seconds...",
-					CONFIG_MQTT_RECONNECT_DELAY_S);
-				k_sleep(K_SECONDS(CONFIG_MQTT_RECONNECT_DELAY_S));
+				uint32_t delay = cfgReconnectDelayGet();
+
+				LOG_INF("Reconnecting in %u seconds...", delay);
+				k_sleep(K_SECONDS(delay));
+			}
+
+			/* A broker set by configuration must send a CONNACK within
+			 * a few attempts, otherwise the confirmed one is used again.
+			 */
+			if (!cfgBrokerPending()) {
+				broker_attempt = 0;
+			} else if (broker_attempt++ >= CONFIG_MQTT_BROKER_FALLBACK_ATTEMPTS) {
+				broker_attempt = 0;
+				if (cfgBrokerRevert()) {
+					atomic_set_bit(&mqtt_flags, MQTT_FLAG_BROKER_RESOLVE);
+				}
+			}
+
+			if (atomic_test_and_clear_bit(&mqtt_flags, MQTT_FLAG_BROKER_RESOLVE)) {
+				err = mqtt_broker_init();
+				if (err) {
+					LOG_ERR("Failed to resolve new broker: %d", err);
+					atomic_set_bit(&mqtt_flags, MQTT_FLAG_BROKER_RESOLVE);
+					goto do_connect;
+				}
 			}
 
 			LOG_INF("Connection to broker using mqtt_connect");
@@ -504,6 +774,12 @@ void mqttConnectionThread(void *p1, void *p2, void *p3) {
 					break;
 				}
 
+				/* Checked at least once per keepalive interval */
+				if (k_uptime_get() - diag_time >= CONFIG_DIAG_PUBLISH_PERIOD_S * MSEC_PER_SEC) {
+					diag_time = k_uptime_get();
+					mqttDiagPublish(&client);
+				}
+
 				if ((fds.revents & POLLIN) == POLLIN) {
 					err = mqtt_input(&client);
 					if (err != 0) {
@@ -521,6 +797,11 @@ void mqttConnectionThread(void *p1, void *p2, void *p3) {
 					LOG_ERR("POLLNVAL");
 					break;
 				}
+
+				if (atomic_test_and_clear_bit(&mqtt_flags, MQTT_FLAG_RECONNECT)) {
+					LOG_INF("Broker changed by configuration");
+					break;
+				}
 			}
 
 			LOG_INF("Disconnecting MQTT client");
@@ -538,8 +819,9 @@ void mqttConnectionThread(void *p1, void *p2, void *p3) {
  * @brief Thread to publish a message periodically to the configured topic.
  *
  * @details This function is run in a separate thread and will publish a message
- *          to the configured topic every n seconds, if the MQTT client is
- *          connected.
+ *          to the configured topic every configured period, if the MQTT
+ *          client is connected. A new period takes effect right away, counted
+ *          from the moment it is applied.
  */
 static void mqttPublishThread(void) {
     while (1) {
@@ -554,6 +836,9 @@ static void mqttPublishThread(void) {
         }
         k_mutex_unlock(&mqtt_mutex);
 
-        k_sleep(K_SECONDS(CONFIG_MQTT_PUBLISH_PERIOD_S));
+        /* A period change restarts the wait with the new period */
+        while (k_sem_take(&mqtt_period_changed,
+                          K_SECONDS(cfgPublishPeriodGet())) == 0) {
+        }
     }
 }
\ No newline at end of file
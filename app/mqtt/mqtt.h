@@ -18,7 +18,6 @@
 #endif
 
 #define IMEI_LEN 15
-#define CGSN_RESPONSE_LENGTH (IMEI_LEN + 6 + 1)
 #define CLIENT_ID_LEN sizeof("nrf-") + IMEI_LEN
 
 /**@brief Initialize the MQTT client structure
@@ -0,0 +1,537 @@
+"""Simulador de frota para teste de carga do broker.
+
+Roda milhares de dispositivos em um único processo (asyncio), cada um com
+o mesmo comportamento do cliente de app/mqtt/mqtt.c: conecta, assina os
+tópicos de comando e de configuração, publica o registro de boot e o
+diagnóstico a cada conexão, publica "1" no tópico de status a cada período
+com QoS 1 e, ao perder a conexão, espera o atraso de reconexão antes de
+tentar de novo. Configurações recebidas no tópico de configuração são
+aplicadas e confirmadas como no firmware.
+
+Quedas de LTE são roteirizadas com --event INICIO:FRACAO:DURACAO, por
+exemplo "--event 120:0.5:60" derruba metade da frota aos 120 s por 60 s.
+Como no firmware, a queda não fecha o socket: a sessão fica meio-aberta no
+broker até o keepalive expirar ou o mesmo client ID reconectar (takeover),
+e o dispositivo segue tentando conectar a cada atraso de reconexão, sem
+sucesso até a volta do LTE e o registro na rede. Isso reproduz a
+tempestade de conexões.
+
+  python fleetSim.py --devices 2000 --duration 600 --event 120:0.5:60
+
+Para muitos dispositivos, aumente o limite de arquivos abertos (ulimit -n).
+"""
+
+import argparse
+import asyncio
+import random
+import struct
+import sys
+import time
+from collections import Counter
+
+# Tipos de pacote MQTT 3.1.1
+CONNECT = 1
+CONNACK = 2
+PUBLISH = 3
+PUBACK = 4
+SUBSCRIBE = 8
+SUBACK = 9
+PINGREQ = 12
+PINGRESP = 13
+DISCONNECT = 14
+
+# Erros do firmware devolvidos na confirmação de configuração
+EINVAL = -22
+EALREADY = -114
+
+# Chaves aceitas por cfgApply() (app/cfg/cfg.c) sem
+# CONFIG_MQTT_CFG_REMOTE_BROKER: (mínimo, máximo) para números, None para
+# tópicos.
+CFG_FIELDS = {
+    "ver": (1, 2**32 - 1),
+    "period": (5, 86400),
+    "reconnect": (1, 3600),
+    "pub": None,
+    "sub": None,
+}
+CFG_STR_LEN = 64
+CFG_VERSION_MAX_STEP = 1000     # CONFIG_MQTT_CFG_VERSION_MAX_STEP
+
+# Diagnóstico como em mqttDiagPublish(): buffers e heap, depois as threads
+# (nome, pilha usada, tamanho), dividido em páginas que cabem no buffer TX.
+MQTT_MESSAGE_BUFFER_SIZE = 256  # CONFIG_MQTT_MESSAGE_BUFFER_SIZE
+DIAG_THREADS = (("mqttConnec", 1480, 2048), ("mqttPublis", 610, 1024),
+                ("modemQuery", 720, 1536), ("lteHandler", 890, 1536),
+                ("sysworkq", 850, 2048), ("logging", 520, 768),
+                ("idle", 64, 320), ("main", 2200, 4096))
+
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        b = n % 128
+        n //= 128
+        out.append(b | 0x80 if n else b)
+        if not n:
+            return bytes(out)
+
+
+def encode_str(s):
+    data = s.encode()
+    return struct.pack("!H", len(data)) + data
+
+
+def packet(ptype, flags, body):
+    return bytes([(ptype << 4) | flags]) + encode_length(len(body)) + body
+
+
+async def read_packet(reader):
+    header = await reader.readexactly(1)
+    mult, length = 1, 0
+    while True:
+        b = (await reader.readexactly(1))[0]
+        length += (b & 0x7F) * mult
+        if not b & 0x80:
+            break
+        mult *= 128
+    body = await reader.readexactly(length) if length else b""
+    return header[0] >> 4, header[0] & 0x0F, body
+
+
+class Metrics:
+    """Métricas agregadas da frota."""
+
+    def __init__(self):
+        self.start = time.monotonic()
+        self.connect_attempts = Counter()   # por segundo desde o início
+        self.connacks = 0
+        self.connect_failures = 0
+        self.disconnects = 0
+        self.publishes = 0
+        self.pubacks = 0
+        self.publishes_qos0 = 0
+        self.offline_attempts = 0           # mqtt_connect() sem LTE
+        self.half_open = 0                  # sessões abandonadas pela queda
+        self.half_open_time = []            # até o broker fechar cada uma
+        self.takeovers = 0                  # CONNACK com a sessão antiga aberta
+        self.connect_latency = []
+        self.publish_latency = []
+        self.cfg_acks = 0
+        self.errors = Counter()             # exceções inesperadas por tipo
+
+    def now(self):
+        return time.monotonic() - self.start
+
+    def report(self, duration):
+        def pct(values, p):
+            if not values:
+                return None
+            values = sorted(values)
+            return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+        def ms(v):
+            return "-" if v is None else "%.1f" % (v * 1000)
+
+        def sec(v):
+            return "-" if v is None else "%.0f" % v
+
+        peak_sec, peak = max(self.connect_attempts.items(), key=lambda kv: kv[1],
+                             default=(0, 0))
+        print("Duração: %.0f s" % duration)
+        print("Conexões: %d tentativas, %d aceitas, %d falhas, %d quedas" % (
+            sum(self.connect_attempts.values()), self.connacks,
+            self.connect_failures, self.disconnects))
+        print("Pico de conexões: %d/s aos %d s" % (peak, peak_sec))
+        if self.offline_attempts or self.half_open:
+            print("Tentativas sem LTE: %d" % self.offline_attempts)
+            print("Sessões meio-abertas: %d, %d fechadas pelo broker em p50 %s s, "
+                  "p95 %s s; %d reconexões com a sessão antiga aberta" % (
+                      self.half_open, len(self.half_open_time),
+                      sec(pct(self.half_open_time, 50)), sec(pct(self.half_open_time, 95)),
+                      self.takeovers))
+        print("Latência CONNACK (ms): p50 %s, p95 %s, p99 %s" % (
+            ms(pct(self.connect_latency, 50)), ms(pct(self.connect_latency, 95)),
+            ms(pct(self.connect_latency, 99))))
+        print("Publicações: %d enviadas, %d confirmadas, %.1f/s" % (
+            self.publishes, self.pubacks, self.pubacks / duration if duration else 0))
+        print("Latência PUBACK (ms): p50 %s, p95 %s, p99 %s" % (
+            ms(pct(self.publish_latency, 50)), ms(pct(self.publish_latency, 95)),
+            ms(pct(self.publish_latency, 99))))
+        if self.publishes_qos0:
+            print("Diagnósticos: %d mensagens QoS 0" % self.publishes_qos0)
+        if self.cfg_acks:
+            print("Configurações confirmadas: %d" % self.cfg_acks)
+        if self.errors:
+            print("Erros inesperados: %s" % ", ".join(
+                "%s %d" % kv for kv in self.errors.most_common()))
+
+
+class Device:
+    """Um dispositivo simulado, espelhando mqttConnectionThread() e
+    mqttPublishThread()."""
+
+    def __init__(self, n, args, metrics):
+        self.args = args
+        self.metrics = metrics
+        self.client_id = "%s%06d" % (args.id_prefix, n)
+        self.period = args.period
+        self.reconnect_delay = args.reconnect_delay
+        self.sub_topic = args.sub_topic
+        self.cfg_version = 0
+        self.boot_count = 1
+        self.lte_up = asyncio.Event()
+        self.lte_up.set()
+        self.lte_lost = asyncio.Event()
+        self.register = None
+        self.writer = None
+        self.orphan = None
+        self.pending = {}
+        self.next_id = 1
+        self.connected_at = None
+        self.booted_at = None
+        # Uptime em ms de cada enum bootMilestone, None se não alcançado
+        self.milestones = [None] * 6
+        self.diag_count = 0
+
+    def lte_drop(self):
+        """Sem LTE nada sai do modem: a sessão atual para sem FIN nem RST."""
+        self.lte_up.clear()
+        self.lte_lost.set()
+        if self.register is not None:
+            self.register.cancel()
+            self.register = None
+
+    def lte_recover(self):
+        """A rede volta, mas os sockets só funcionam depois do registro."""
+        delay = max(0.0, random.gauss(self.args.register_s, self.args.register_s / 3))
+        self.register = asyncio.get_running_loop().call_later(delay, self.lte_registered)
+
+    def lte_registered(self):
+        self.register = None
+        self.lte_lost.clear()
+        self.lte_up.set()
+
+    def milestone(self, ms):
+        """Como bootMilestoneSet(): só a primeira vez no boot conta."""
+        if self.milestones[ms] is None:
+            self.milestones[ms] = int((time.monotonic() - self.booted_at) * 1000)
+
+    def boot_record(self):
+        """Mesmos campos de bootRecordFormat(); cada boot simulado é o
+        primeiro depois de um power-on, sem linha do tempo anterior."""
+        def times(t):
+            return ",".join("" if v is None else str(v) for v in t)
+        return "n=%d;rc=0;bl=0;pm=-1;pt=%s;t=%s" % (
+            self.boot_count, times([None] * len(self.milestones)), times(self.milestones))
+
+    def diag_pages(self):
+        """Páginas do diagnóstico como diagFormat(); a partir do segundo
+        relatório o valor do sinal já está no cache do modem."""
+        topic = "%s/%s" % (self.args.diag_topic, self.client_id)
+        size = MQTT_MESSAGE_BUFFER_SIZE - 8 - len(topic)
+        first = ""
+        if self.diag_count > 0:
+            first = "cesq=99,99,255,255,%d,%d;cesq_age=%d;" % (
+                random.randint(10, 40), random.randint(20, 60),
+                random.randint(0, self.args.diag_period))
+        first += "buf=rx:%d/256,tx:%d/256,payload:%d/256;heap=0/0/0;thr=" % (
+            random.randint(40, 200), random.randint(40, 200), random.randint(10, 120))
+        self.diag_count += 1
+        page = first
+        for name, used, total in DIAG_THREADS:
+            entry = "%s:%d/%d/%d" % (name, used, total, random.randint(0, 5))
+            sep = "" if page.endswith("=") else ","
+            if len(page) + len(sep) + len(entry) > size:
+                yield topic, page
+                page, sep = "thr=", ""
+            page += sep + entry
+        yield topic, page
+
+    async def publish_diag(self):
+        for topic, page in self.diag_pages():
+            await self.send_publish(topic, page, qos=0)
+
+    def message_id(self):
+        mid = self.next_id
+        self.next_id = mid % 65535 + 1
+        return mid
+
+    async def send_publish(self, topic, payload, qos=1):
+        if self.lte_lost.is_set():
+            return
+        body = encode_str(topic)
+        if qos:
+            mid = self.message_id()
+            body += struct.pack("!H", mid)
+            self.pending[mid] = time.monotonic()
+        body += payload.encode()
+        self.writer.write(packet(PUBLISH, qos << 1, body))
+        await self.writer.drain()
+        if qos:
+            self.metrics.publishes += 1
+        else:
+            self.metrics.publishes_qos0 += 1
+
+    def apply_cfg(self, payload):
+        """Aplica uma configuração "chave=valor;..." como cfgApply(): a
+        mensagem é validada inteira e todos os pares são aplicados, ou
+        nenhum. Tópicos só são validados, o simulador continua nos tópicos
+        da linha de comando."""
+        values = {}
+        for pair in payload.replace("\r", ";").replace("\n", ";").split(";"):
+            if not pair:
+                continue
+            key, sep, value = pair.partition("=")
+            if not sep or key not in CFG_FIELDS:
+                return EINVAL
+            limits = CFG_FIELDS[key]
+            if limits is None:
+                if (not 0 < len(value.encode()) < CFG_STR_LEN
+                        or not all("!" <= c <= "~" for c in value)
+                        or (key == "pub" and ("+" in value or "#" in value))):
+                    return EINVAL
+            else:
+                if not (value.isascii() and value.isdigit()):
+                    return EINVAL
+                value = int(value)
+                if not limits[0] <= value <= limits[1]:
+                    return EINVAL
+            values[key] = value
+        if "ver" not in values:
+            return EINVAL
+        if values["ver"] <= self.cfg_version:
+            return EALREADY
+        if values["ver"] - self.cfg_version > CFG_VERSION_MAX_STEP:
+            return EINVAL
+        self.cfg_version = values["ver"]
+        self.period = values.get("period", self.period)
+        self.reconnect_delay = values.get("reconnect", self.reconnect_delay)
+        return 0
+
+    async def handle(self, ptype, flags, body):
+        if ptype == PUBACK:
+            (mid,) = struct.unpack("!H", body[:2])
+            sent = self.pending.pop(mid, None)
+            if sent is not None:
+                self.metrics.pubacks += 1
+                self.metrics.publish_latency.append(time.monotonic() - sent)
+        elif ptype == PUBLISH:
+            qos = (flags >> 1) & 3
+            (tlen,) = struct.unpack("!H", body[:2])
+            topic = body[2:2 + tlen].decode()
+            pos = 2 + tlen
+            if qos:
+                mid = body[pos:pos + 2]
+                pos += 2
+                self.writer.write(packet(PUBACK, 0, mid))
+            if topic == self.args.cfg_topic:
+                err = self.apply_cfg(body[pos:].decode("utf-8", "replace"))
+                await self.send_publish("%s/%s" % (self.args.cfg_ack_topic, self.client_id),
+                                        "ver=%d;err=%d" % (self.cfg_version, err))
+                self.metrics.cfg_acks += 1
+
+    async def reader_loop(self, reader):
+        while True:
+            ptype, flags, body = await read_packet(reader)
+            await self.handle(ptype, flags, body)
+
+    async def publish_loop(self):
+        # Mesmo desvio de fase dos dispositivos reais, que publicam a partir do boot
+        await asyncio.sleep(random.uniform(0, self.period))
+        while True:
+            await self.send_publish(self.args.pub_topic, "1")
+            await asyncio.sleep(self.period)
+
+    async def ping_loop(self):
+        while True:
+            await asyncio.sleep(self.args.keepalive)
+            if not self.lte_lost.is_set():
+                self.writer.write(packet(PINGREQ, 0, b""))
+
+    async def diag_loop(self):
+        while True:
+            await asyncio.sleep(self.args.diag_period)
+            await self.publish_diag()
+
+    async def half_open(self, reader, writer):
+        """Mantém o socket de uma sessão interrompida pelo LTE sem I/O, até o
+        broker fechá-lo (keepalive expirado ou takeover). Só o fechamento do
+        broker é lido, nada é enviado."""
+        self.metrics.half_open += 1
+        t0 = time.monotonic()
+        try:
+            # Com keepalive de 1,5x o broker já deveria ter fechado
+            await asyncio.wait_for(reader.read(), self.args.keepalive * 3)
+            self.metrics.half_open_time.append(time.monotonic() - t0)
+        except (OSError, asyncio.TimeoutError, ConnectionError):
+            pass
+        finally:
+            writer.transport.abort()
+            if self.orphan is asyncio.current_task():
+                self.orphan = None
+
+    async def session(self):
+        """Uma conexão ao broker, até ela cair ou o LTE cair."""
+        self.metrics.connect_attempts[int(self.metrics.now())] += 1
+        self.milestone(3)   # BOOT_MS_LTE_REGISTERED
+        self.milestone(4)   # BOOT_MS_MQTT_INIT
+        t0 = time.monotonic()
+        reader, self.writer = await asyncio.wait_for(
+            asyncio.open_connection(self.args.host, self.args.port), self.args.timeout)
+
+        body = encode_str("MQTT") + bytes([4, 0x02]) + struct.pack("!H", self.args.keepalive)
+        body += encode_str(self.client_id)
+        self.writer.write(packet(CONNECT, 0, body))
+        await self.writer.drain()
+
+        ptype, _, ack = await asyncio.wait_for(read_packet(reader), self.args.timeout)
+        if ptype != CONNACK or ack[1] != 0:
+            raise ConnectionError("CONNACK %s" % ack.hex())
+        self.metrics.connacks += 1
+        self.metrics.connect_latency.append(time.monotonic() - t0)
+        self.connected_at = time.monotonic()
+        if self.orphan is not None:
+            self.metrics.takeovers += 1
+        self.milestone(5)   # BOOT_MS_MQTT_CONNECTED
+
+        sub = struct.pack("!H", 1234)
+        for topic in (self.sub_topic, self.args.cfg_topic):
+            sub += encode_str(topic) + b"\x01"
+        self.writer.write(packet(SUBSCRIBE, 2, sub))
+        await self.send_publish("%s/%s" % (self.args.boot_topic, self.client_id),
+                                self.boot_record())
+        await self.publish_diag()
+
+        tasks = [asyncio.ensure_future(c) for c in
+                 (self.reader_loop(reader), self.publish_loop(), self.ping_loop(),
+                  self.diag_loop(), self.lte_lost.wait())]
+        try:
+            done, _ = await asyncio.wait(tasks, return_when=asyncio.FIRST_COMPLETED)
+            for t in done:
+                if t.exception() is not None:
+                    raise t.exception()
+        finally:
+            for t in tasks:
+                t.cancel()
+            if self.lte_lost.is_set():
+                self.orphan = asyncio.ensure_future(self.half_open(reader, self.writer))
+            else:
+                self.writer.transport.abort()
+            self.writer = None
+            self.pending.clear()
+
+    async def run(self):
+        await asyncio.sleep(random.uniform(0, self.args.ramp))
+        self.booted_at = time.monotonic()
+        # BOOT_MS_START, CFG_LOADED e MODEM_INIT, com tempos típicos, e o
+        # registro na rede antes da primeira conexão
+        self.milestones[:3] = [0, random.randint(30, 60), random.randint(150, 300)]
+        await asyncio.sleep(0.3 + max(0.0, random.gauss(self.args.register_s,
+                                                        self.args.register_s / 3)))
+        attempt = 0
+        while True:
+            if attempt > 0:
+                await asyncio.sleep(self.reconnect_delay)
+            attempt += 1
+            self.connected_at = None
+            if not self.lte_up.is_set():
+                # O firmware não trata a queda: mqtt_connect() segue sendo
+                # chamado e falha sem chegar ao broker
+                self.metrics.offline_attempts += 1
+                continue
+            try:
+                await self.session()
+            except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError,
+                    ConnectionError):
+                pass
+            except Exception as e:
+                # Um bug do simulador não pode sumir com o dispositivo: conta,
+                # avisa na primeira vez e segue reconectando.
+                name = type(e).__name__
+                if not self.metrics.errors[name]:
+                    print("%s: %s: %s" % (self.client_id, name, e), file=sys.stderr)
+                self.metrics.errors[name] += 1
+            if self.connected_at is None:
+                self.metrics.connect_failures += 1
+            else:
+                self.metrics.disconnects += 1
+
+
+async def scripted_events(devices, events):
+    """Executa as quedas de LTE roteirizadas (inicio, fracao, duracao)."""
+    async def one(at, fraction, duration):
+        await asyncio.sleep(at)
+        hit = random.sample(devices, int(len(devices) * fraction))
+        print("[%5.0f s] LTE caiu em %d dispositivos por %.0f s" % (at, len(hit), duration))
+        for d in hit:
+            d.lte_drop()
+        await asyncio.sleep(duration)
+        print("[%5.0f s] LTE voltou em %d dispositivos" % (at + duration, len(hit)))
+        for d in hit:
+            d.lte_recover()
+
+    await asyncio.gather(*(one(*e) for e in events))
+
+
+def parse_event(value):
+    try:
+        at, fraction, duration = (float(v) for v in value.split(":"))
+    except ValueError:
+        raise argparse.ArgumentTypeError("formato esperado INICIO:FRACAO:DURACAO")
+    # Fora de 0..1 o random.sample() falharia só na hora do evento, em silêncio
+    if not 0 <= fraction <= 1:
+        raise argparse.ArgumentTypeError("FRACAO deve estar entre 0 e 1: %s" % value)
+    if at < 0 or duration < 0:
+        raise argparse.ArgumentTypeError("INICIO e DURACAO não podem ser negativos: %s" % value)
+    return at, fraction, duration
+
+
+async def main_async(args):
+    metrics = Metrics()
+    devices = [Device(n, args, metrics) for n in range(args.devices)]
+    tasks = [asyncio.ensure_future(d.run()) for d in devices]
+    tasks.append(asyncio.ensure_future(scripted_events(devices, args.event)))
+
+    await asyncio.sleep(args.duration)
+    for t in tasks:
+        t.cancel()
+    await asyncio.gather(*tasks, return_exceptions=True)
+    metrics.report(metrics.now())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--devices", type=int, default=100)
+    parser.add_argument("--duration", type=float, default=300, help="segundos de simulação")
+    parser.add_argument("--ramp", type=float, default=10,
+                        help="segundos em que os boots iniciais são espalhados")
+    parser.add_argument("--period", type=int, default=30, help="CONFIG_MQTT_PUBLISH_PERIOD_S")
+    parser.add_argument("--reconnect-delay", type=int, default=5,
+                        help="CONFIG_MQTT_RECONNECT_DELAY_S")
+    parser.add_argument("--keepalive", type=int, default=60, help="CONFIG_MQTT_KEEPALIVE")
+    parser.add_argument("--register-s", type=float, default=7,
+                        help="tempo médio de registro na rede após a volta do LTE")
+    parser.add_argument("--timeout", type=float, default=10)
+    parser.add_argument("--event", type=parse_event, action="append", default=[],
+                        help="queda de LTE INICIO:FRACAO:DURACAO, pode repetir")
+    parser.add_argument("--id-prefix", default="sim-")
+    parser.add_argument("--pub-topic", default="stlab/up/status")
+    parser.add_argument("--sub-topic", default="stlab/down/cmd")
+    parser.add_argument("--cfg-topic", default="stlab/down/cfg")
+    parser.add_argument("--cfg-ack-topic", default="stlab/up/cfg")
+    parser.add_argument("--boot-topic", default="stlab/up/boot")
+    parser.add_argument("--diag-topic", default="stlab/up/diag")
+    parser.add_argument("--diag-period", type=int, default=3600,
+                        help="CONFIG_DIAG_PUBLISH_PERIOD_S")
+    args = parser.parse_args()
+
+    try:
+        asyncio.run(main_async(args))
+    except KeyboardInterrupt:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
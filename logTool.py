@@ -0,0 +1,474 @@
+"""Captura e análise de logs do dispositivo.
+
+Substitui o serialRead.py. Uso:
+
+  python logTool.py capture [--port /dev/ttyUSB0] [--log log.txt] [--out log.stl]
+  python logTool.py ingest log25,09.txt [--out log25,09.stl]
+  python logTool.py stats log25,09.txt|log25,09.stl [--since ...] [--until ...] [--json]
+
+O formato .stl guarda só os eventos relevantes do log em blocos colunares
+(timestamps em delta de uint32 e códigos de evento em uint8), com um índice
+de blocos no final para pular direto para um intervalo de tempo. Se a
+captura morrer antes de gravar o índice, ele é reconstruído na leitura.
+"""
+
+import argparse
+import bisect
+import calendar
+import json
+import math
+import os
+import signal
+import struct
+import sys
+import time
+from array import array
+
+# Eventos reconhecidos no log
+EVT_BOOT = 1
+EVT_LTE_INIT = 2
+EVT_REGISTERED = 3
+EVT_RRC_CONNECTED = 4
+EVT_RRC_IDLE = 5
+EVT_MQTT_CONNECTED = 6
+EVT_MQTT_DISCONNECTED = 7
+EVT_RECONNECT = 8
+EVT_PUBLISH = 9
+EVT_ERROR = 10
+
+EVT_NAMES = {
+    EVT_BOOT: "boot",
+    EVT_LTE_INIT: "lte_init",
+    EVT_REGISTERED: "registered",
+    EVT_RRC_CONNECTED: "rrc_connected",
+    EVT_RRC_IDLE: "rrc_idle",
+    EVT_MQTT_CONNECTED: "mqtt_connected",
+    EVT_MQTT_DISCONNECTED: "mqtt_disconnected",
+    EVT_RECONNECT: "reconnect",
+    EVT_PUBLISH: "publish",
+    EVT_ERROR: "error",
+}
+
+# Padrões procurados em cada linha, em ordem. Funcionam tanto para o log
+# mínimo ("I: ...") quanto para o completo ("<inf> lte: ..."). O boot vem
+# primeiro porque um reset pode cortar a linha anterior no meio.
+PATTERNS = (
+    (b"*** Booting", EVT_BOOT),
+    (b"RRC mode: Connected", EVT_RRC_CONNECTED),
+    (b"RRC mode: Idle", EVT_RRC_IDLE),
+    (b"Network registration status: Connected", EVT_REGISTERED),
+    (b"lteInit", EVT_LTE_INIT),
+    (b"MQTT client connected", EVT_MQTT_CONNECTED),
+    (b"MQTT client disconnected", EVT_MQTT_DISCONNECTED),
+    (b"Reconnecting in", EVT_RECONNECT),
+    (b"E: ", EVT_ERROR),
+    (b"<err>", EVT_ERROR),
+)
+
+# Formato .stl
+FILE_MAGIC = b"STLOG01\0"
+BLOCK_MAGIC = b"BLK0"
+INDEX_MAGIC = b"IDX0"
+BLOCK_HEADER = struct.Struct("<4sIq")   # magic, count, first_ts
+INDEX_ENTRY = struct.Struct("<QqqI")    # offset, first_ts, last_ts, count
+FOOTER = struct.Struct("<QI4s")         # index offset, block count, magic
+BLOCK_EVENTS = 65536
+SYNC_S = 60          # capture grava o bloco parcial a cada SYNC_S segundos
+
+
+def classify(msg, publish_marker):
+    """Retorna o código do evento de uma linha, ou 0 se não interessa."""
+    # Boot antes de tudo, também antes de "Publishing ": um reset pode
+    # cortar a linha de publicação e colar o banner nela.
+    if b"*** Booting" in msg:
+        return EVT_BOOT
+    if b"Publishing " in msg:
+        # Só as publicações periódicas entram na análise de jitter
+        return EVT_PUBLISH if publish_marker in msg else 0
+    for pattern, code in PATTERNS:
+        if pattern in msg:
+            return code
+    return 0
+
+
+def parse_text(path, topic):
+    """Lê um log texto ("AAAA-MM-DD HH:MM:SS - msg") e gera (ts, evento)."""
+    publish_marker = ('on "%s"' % topic).encode()
+    day_cache = {}
+    with open(path, "rb", buffering=1 << 20) as f:
+        for line in f:
+            if len(line) < 22 or line[19:22] != b" - ":
+                continue
+            day = line[:10]
+            base = day_cache.get(day)
+            if base is None:
+                try:
+                    base = calendar.timegm(time.strptime(day.decode(), "%Y-%m-%d"))
+                except ValueError:
+                    continue
+                day_cache[day] = base
+            try:
+                ts = base + int(line[11:13]) * 3600 + int(line[14:16]) * 60 + int(line[17:19])
+            except ValueError:
+                continue
+            code = classify(line[22:], publish_marker)
+            if code:
+                yield ts, code
+
+
+class StlWriter:
+    """Escreve eventos no formato .stl em blocos de BLOCK_EVENTS."""
+
+    def __init__(self, path):
+        self.f = open(path, "wb")
+        self.f.write(FILE_MAGIC)
+        self.index = []
+        self.ts = array("q")
+        self.codes = array("B")
+
+    def add(self, ts, code):
+        # Os deltas do bloco não podem ser negativos (relógio ajustado)
+        if self.ts and ts < self.ts[0]:
+            self.flush()
+        self.ts.append(ts)
+        self.codes.append(code)
+        if len(self.codes) >= BLOCK_EVENTS:
+            self.flush()
+
+    def flush(self):
+        if not self.codes:
+            return
+        first = self.ts[0]
+        deltas = array("I", (t - first for t in self.ts))
+        self.index.append((self.f.tell(), first, self.ts[-1], len(self.codes)))
+        self.f.write(BLOCK_HEADER.pack(BLOCK_MAGIC, len(self.codes), first))
+        self.f.write(deltas.tobytes())
+        self.f.write(self.codes.tobytes())
+        self.ts = array("q")
+        self.codes = array("B")
+
+    def sync(self):
+        """Grava o bloco parcial no disco. Se o processo morrer antes de
+        close(), read_stl() reconstrói o índice a partir dos blocos."""
+        self.flush()
+        self.f.flush()
+
+    def close(self):
+        self.flush()
+        index_offset = self.f.tell()
+        for entry in self.index:
+            self.f.write(INDEX_ENTRY.pack(*entry))
+        self.f.write(FOOTER.pack(index_offset, len(self.index), INDEX_MAGIC))
+        self.f.close()
+
+
+def scan_blocks(f, size):
+    """Reconstrói o índice percorrendo os cabeçalhos BLK0, para arquivos
+    sem rodapé (captura interrompida). Para no primeiro bloco truncado."""
+    index = []
+    pos = len(FILE_MAGIC)
+    while pos + BLOCK_HEADER.size <= size:
+        f.seek(pos)
+        magic, n, first = BLOCK_HEADER.unpack(f.read(BLOCK_HEADER.size))
+        end = pos + BLOCK_HEADER.size + 5 * n
+        if magic != BLOCK_MAGIC or n == 0 or end > size:
+            break
+        f.seek(pos + BLOCK_HEADER.size + 4 * (n - 1))
+        (last,) = struct.unpack("<I", f.read(4))
+        index.append((pos, first, first + last, n))
+        pos = end
+    return index
+
+
+def read_stl(path, since=None, until=None):
+    """Gera (ts, evento) de um arquivo .stl, usando o índice para pular blocos."""
+    with open(path, "rb") as f:
+        if f.read(len(FILE_MAGIC)) != FILE_MAGIC:
+            raise ValueError("%s: não é um arquivo .stl" % path)
+        size = f.seek(0, os.SEEK_END)
+        magic = None
+        if size >= len(FILE_MAGIC) + FOOTER.size:
+            f.seek(-FOOTER.size, os.SEEK_END)
+            index_offset, count, magic = FOOTER.unpack(f.read(FOOTER.size))
+        if magic == INDEX_MAGIC:
+            f.seek(index_offset)
+            index = [INDEX_ENTRY.unpack(f.read(INDEX_ENTRY.size)) for _ in range(count)]
+        else:
+            index = scan_blocks(f, size)
+            print("%s: índice ausente, reconstruído a partir de %d blocos" % (path, len(index)),
+                  file=sys.stderr)
+
+        # Os blocos estão em ordem de tempo: o primeiro que interessa é o
+        # primeiro que termina depois de 'since'.
+        start = 0
+        if since is not None:
+            start = bisect.bisect_left([e[2] for e in index], since)
+
+        for offset, first_ts, last_ts, n in index[start:]:
+            if until is not None and first_ts > until:
+                break
+            f.seek(offset)
+            _, n, first = BLOCK_HEADER.unpack(f.read(BLOCK_HEADER.size))
+            deltas = array("I")
+            deltas.frombytes(f.read(4 * n))
+            codes = array("B")
+            codes.frombytes(f.read(n))
+            for delta, code in zip(deltas, codes):
+                ts = first + delta
+                if since is not None and ts < since:
+                    continue
+                if until is not None and ts > until:
+                    return
+                yield ts, code
+
+
+class LinkStats:
+    """Métricas de enlace calculadas em uma passada, com memória constante
+    exceto pelos tempos de registro (um valor por boot que registrou)."""
+
+    def __init__(self, period):
+        self.period = period
+        self.first_ts = None
+        self.last_ts = None
+        self.counts = dict.fromkeys(EVT_NAMES, 0)
+        self.boot_ts = None
+        self.register_times = array("f")
+        self.rrc_since = None
+        self.rrc_connected_s = 0
+        self.last_pub = None
+        self.pub_n = 0
+        self.pub_mean = 0.0
+        self.pub_m2 = 0.0
+        self.pub_max = 0
+        self.pub_gaps = 0
+
+    def _rrc_close(self, ts):
+        if self.rrc_since is not None:
+            self.rrc_connected_s += ts - self.rrc_since
+            self.rrc_since = None
+
+    def feed(self, ts, code):
+        if self.first_ts is None:
+            self.first_ts = ts
+        self.last_ts = ts
+        self.counts[code] += 1
+
+        if code == EVT_BOOT:
+            self.boot_ts = ts
+            self.last_pub = None
+            self._rrc_close(ts)
+        elif code == EVT_REGISTERED:
+            if self.boot_ts is not None:
+                self.register_times.append(ts - self.boot_ts)
+                self.boot_ts = None
+        elif code == EVT_RRC_CONNECTED:
+            if self.rrc_since is None:
+                self.rrc_since = ts
+        elif code == EVT_RRC_IDLE:
+            self._rrc_close(ts)
+        elif code == EVT_PUBLISH:
+            if self.last_pub is not None:
+                interval = ts - self.last_pub
+                # Welford para média e desvio padrão dos intervalos
+                self.pub_n += 1
+                d = interval - self.pub_mean
+                self.pub_mean += d / self.pub_n
+                self.pub_m2 += d * (interval - self.pub_mean)
+                self.pub_max = max(self.pub_max, interval)
+                if interval > 2 * self.period:
+                    self.pub_gaps += 1
+            self.last_pub = ts
+
+    def result(self):
+        if self.rrc_since is not None:
+            self._rrc_close(self.last_ts)
+        span = (self.last_ts - self.first_ts) if self.first_ts is not None else 0
+        hours = span / 3600.0
+        reg = sorted(self.register_times)
+
+        def pct(p):
+            if not reg:
+                return None
+            return reg[min(len(reg) - 1, int(math.ceil(p / 100.0 * len(reg))) - 1)]
+
+        return {
+            "span_s": span,
+            "events": {EVT_NAMES[c]: n for c, n in self.counts.items()},
+            "reboots": self.counts[EVT_BOOT],
+            "reboots_per_hour": self.counts[EVT_BOOT] / hours if hours else None,
+            "registered_boots": len(reg),
+            "time_to_register_s": {
+                "mean": sum(reg) / len(reg) if reg else None,
+                "p50": pct(50),
+                "p95": pct(95),
+                "max": reg[-1] if reg else None,
+            },
+            "rrc_connected_s": self.rrc_connected_s,
+            "rrc_duty_cycle": self.rrc_connected_s / span if span else None,
+            "publish_interval_s": {
+                "count": self.pub_n,
+                "mean": self.pub_mean if self.pub_n else None,
+                "jitter_stddev": math.sqrt(self.pub_m2 / self.pub_n) if self.pub_n else None,
+                "max": self.pub_max if self.pub_n else None,
+                "gaps_over_2x_period": self.pub_gaps,
+            },
+            "mqtt_connects": self.counts[EVT_MQTT_CONNECTED],
+            "reconnects": self.counts[EVT_RECONNECT],
+        }
+
+
+def print_stats(res):
+    def fmt(v, spec="%.1f"):
+        return "-" if v is None else spec % v
+
+    reg = res["time_to_register_s"]
+    pub = res["publish_interval_s"]
+    print("Intervalo analisado: %.2f h" % (res["span_s"] / 3600.0))
+    print("Reboots: %d (%s/h)" % (res["reboots"], fmt(res["reboots_per_hour"])))
+    print("Tempo até registrar: %d boots, média %s s, p50 %s s, p95 %s s, máx %s s" % (
+        res["registered_boots"], fmt(reg["mean"]), fmt(reg["p50"], "%d"),
+        fmt(reg["p95"], "%d"), fmt(reg["max"], "%d")))
+    print("RRC conectado: %d s (duty cycle %s%%)" % (
+        res["rrc_connected_s"],
+        fmt(res["rrc_duty_cycle"] * 100 if res["rrc_duty_cycle"] is not None else None)))
+    print("Publicações: %d intervalos, média %s s, jitter %s s, máx %s s, %d lacunas" % (
+        pub["count"], fmt(pub["mean"]), fmt(pub["jitter_stddev"], "%.2f"),
+        fmt(pub["max"], "%d"), pub["gaps_over_2x_period"]))
+    print("MQTT: %d conexões, %d reconexões, %d desconexões, %d erros" % (
+        res["mqtt_connects"], res["reconnects"],
+        res["events"]["mqtt_disconnected"], res["events"]["error"]))
+
+
+def parse_time(value):
+    """Converte "AAAA-MM-DD HH:MM:SS" no mesmo relógio dos timestamps do log."""
+    return calendar.timegm(time.strptime(value, "%Y-%m-%d %H:%M:%S"))
+
+
+def cmd_capture(args):
+    import serial
+
+    ser = serial.Serial(args.port, baudrate=args.baudrate, timeout=1)
+    writer = StlWriter(args.out) if args.out else None
+    publish_marker = ('on "%s"' % args.topic).encode()
+    pending = b""
+    text = []
+    last_flush = last_sync = time.monotonic()
+
+    # SIGTERM e terminal fechado também passam pelo finally, que grava o índice
+    def stop(signum, frame):
+        raise KeyboardInterrupt
+    signal.signal(signal.SIGTERM, stop)
+    if hasattr(signal, "SIGHUP"):
+        signal.signal(signal.SIGHUP, stop)
+
+    print("Lendo dados da serial e salvando em %s..." % args.log)
+    with open(args.log, "ab", buffering=1 << 16) as log_file:
+        try:
+            while True:
+                chunk = ser.read(ser.in_waiting or 1)
+                if chunk:
+                    # Um timestamp por leitura basta: a resolução é de 1 s
+                    now = time.time()
+                    stamp = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(now)).encode()
+                    ts = calendar.timegm(time.localtime(now))
+                    lines = (pending + chunk).split(b"\n")
+                    pending = lines.pop()
+                    for line in lines:
+                        line = line.rstrip(b"\r")
+                        text.append(stamp + b" - " + line + b"\n")
+                        if writer:
+                            code = classify(line, publish_marker)
+                            if code:
+                                writer.add(ts, code)
+                        if args.echo:
+                            print(line.decode("utf-8", "replace"))
+
+                # Grava em lote, no máximo a cada --flush segundos
+                if text and time.monotonic() - last_flush >= args.flush:
+                    log_file.write(b"".join(text))
+                    log_file.flush()
+                    text = []
+                    last_flush = time.monotonic()
+
+                if writer and time.monotonic() - last_sync >= SYNC_S:
+                    writer.sync()
+                    last_sync = time.monotonic()
+
+        except KeyboardInterrupt:
+            print("Leitura interrompida")
+
+        finally:
+            log_file.write(b"".join(text))
+            ser.close()
+            if writer:
+                writer.close()
+
+
+def cmd_ingest(args):
+    out = args.out or os.path.splitext(args.log)[0] + ".stl"
+    writer = StlWriter(out)
+    n = 0
+    for ts, code in parse_text(args.log, args.topic):
+        writer.add(ts, code)
+        n += 1
+    writer.close()
+    print("%d eventos gravados em %s" % (n, out))
+
+
+def cmd_stats(args):
+    since = parse_time(args.since) if args.since else None
+    until = parse_time(args.until) if args.until else None
+    stats = LinkStats(args.period)
+
+    if args.log.endswith(".stl"):
+        events = read_stl(args.log, since, until)
+    else:
+        events = ((ts, code) for ts, code in parse_text(args.log, args.topic)
+                  if (since is None or ts >= since) and (until is None or ts <= until))
+
+    for ts, code in events:
+        stats.feed(ts, code)
+
+    res = stats.result()
+    if args.json:
+        json.dump(res, sys.stdout, indent=2)
+        print()
+    else:
+        print_stats(res)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--topic", default="stlab/up/status",
+                        help="tópico das publicações periódicas")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+
+    p = sub.add_parser("capture", help="lê a serial, grava o log texto e, opcionalmente, o .stl")
+    p.add_argument("--port", default="/dev/ttyUSB0")
+    p.add_argument("--baudrate", type=int, default=115200)
+    p.add_argument("--log", default="log.txt", help="log texto, em modo de adição")
+    p.add_argument("--out", help="arquivo .stl gerado durante a captura")
+    p.add_argument("--flush", type=float, default=2.0, help="segundos entre gravações")
+    p.add_argument("--echo", action="store_true", help="exibe as linhas no terminal")
+    p.set_defaults(func=cmd_capture)
+
+    p = sub.add_parser("ingest", help="converte um log texto para .stl")
+    p.add_argument("log")
+    p.add_argument("--out")
+    p.set_defaults(func=cmd_ingest)
+
+    p = sub.add_parser("stats", help="calcula as métricas de enlace de um log texto ou .stl")
+    p.add_argument("log")
+    p.add_argument("--since", help='"AAAA-MM-DD HH:MM:SS"')
+    p.add_argument("--until", help='"AAAA-MM-DD HH:MM:SS"')
+    p.add_argument("--period", type=int, default=30,
+                   help="período de publicação esperado, em segundos")
+    p.add_argument("--json", action="store_true")
+    p.set_defaults(func=cmd_stats)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()